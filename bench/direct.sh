@@ -0,0 +1,68 @@
+#!/bin/sh
+# Buffered against direct I/O: one JSON object per scenario on stdout.
+#   load: insert BENCH_ROWS random keys into an empty database
+#   mix:  run BENCH_OPS statements of BENCH_MIX against the loaded database
+# Each scenario runs with and without --direct-io. Besides the engine report
+# (statements/s, page I/O, peak RSS) it records how much of the database
+# file is left in the OS page cache, memory the buffer pool duplicates in
+# buffered mode; -1 when fincore(1) is not installed.
+#
+# environment:
+#   BENCH_ROWS         table size, default 200000
+#   BENCH_OPS          statements of the mix, default 2000
+#   BENCH_MIX          insert:select:delete weights, default "20:70:10"
+#   BENCH_CACHE_PAGES  frames of the buffer pool, default 256
+#   BENCH_ARGS         extra myjql arguments, e.g. "--dirty-target 20"
+#   BENCH_DIR          directory of the databases, default TMPDIR; direct
+#                      I/O needs a file system that supports it (not tmpfs)
+
+cd "$(dirname "$0")/.."
+MYJQL=./myjql
+WORKLOAD=bench/workload
+ROWS=${BENCH_ROWS:-200000}
+OPS=${BENCH_OPS:-2000}
+MIX=${BENCH_MIX:-"20:70:10"}
+CACHE_PAGES=${BENCH_CACHE_PAGES:-256}
+
+TMP=$(mktemp -d "${BENCH_DIR:-${TMPDIR:-/tmp}}/myjql-direct.XXXXXX")
+trap 'rm -rf "$TMP"' EXIT
+
+$WORKLOAD --phase load --rows "$ROWS" --keys random >"$TMP/load.txt"
+$WORKLOAD --phase mix --rows "$ROWS" --ops "$OPS" --keys random \
+    --mix "$MIX" >"$TMP/mix.txt"
+
+# bytes of FILE in the page cache
+cached_bytes() {
+    if command -v fincore >/dev/null 2>&1; then
+        fincore --bytes --noheadings --output RES "$1" | tr -d ' '
+    else
+        echo -1
+    fi
+}
+
+# run_scenario NAME IO_ARGS DB SCRIPT
+run_scenario() {
+    rm -f "$TMP/report.json"
+    $MYJQL --cache-pages "$CACHE_PAGES" $2 $BENCH_ARGS --batch "$4" \
+        --report "$TMP/report.json" "$3" >/dev/null 2>"$TMP/stderr"
+    status=$?
+    if [ $status -eq 0 ] && [ -s "$TMP/report.json" ]; then
+        printf '{%s,"status":"ok","page_cache_bytes":%s,%s\n' "$1" \
+            "$(cached_bytes "$3")" "$(cut -c2- "$TMP/report.json")"
+    else
+        printf '{%s,"status":"failed","exit":%d}\n' "$1" "$status"
+    fi
+}
+
+for io in buffered direct; do
+    args=""
+    if [ $io = direct ]; then
+        args="--direct-io"
+    fi
+    common="\"io\":\"$io\",\"rows\":$ROWS,\"cache_pages\":$CACHE_PAGES"
+    rm -f "$TMP/$io.db"
+    run_scenario "\"phase\":\"load\",$common" "$args" "$TMP/$io.db" \
+        "$TMP/load.txt"
+    run_scenario "\"phase\":\"mix\",\"mix\":\"$MIX\",\"ops\":$OPS,$common" \
+        "$args" "$TMP/$io.db" "$TMP/mix.txt"
+done
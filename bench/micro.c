@@ -0,0 +1,262 @@
+/* Microbenchmarks for the node-level kernels of myjql.c */
+/* Build: make bench/micro (links myjql.c without its main) */
+/* Usage: bench/micro [--page-size BYTES], one JSON object per kernel */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../myjql.h"
+
+uint64_t rng_state = 88172645463325252ULL;
+uint32_t next_random() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void report(const char* kernel, uint64_t iterations, uint64_t nanoseconds) {
+    printf("{\"kernel\":\"%s\",\"page_size\":%u,\"iterations\":%llu,"
+           "\"ns_per_op\":%.2f}\n",
+           kernel, pager.page_size, (unsigned long long)iterations,
+           (double)nanoseconds / iterations);
+}
+
+// keep the optimizer from dropping results
+volatile uint32_t sink;
+
+/*
+ *synthetic pages: every kernel starts from a fresh in-memory database in a
+ *scratch file that is never flushed except by evictions
+ */
+char scratch_path[] = "/tmp/myjql-micro.XXXXXX";
+uint32_t page_size = 4096;
+
+void drop_frames() { pager_evict_all(); }
+
+void fresh_table() {
+    if (pager.file_descriptor > 0) {
+        db_close();
+    }
+    if (truncate(scratch_path, 0) == -1) {
+        perror("truncate");
+    }
+    open_file(scratch_path, page_size, 0);
+}
+
+// full leaf with keys 0, 2, 4, ...
+void fill_leaf(leaf_node* node, uint32_t num_cells) {
+    for (uint32_t i = 0; i < num_cells; i++) {
+        node->values[i].a = i * 2;
+        snprintf(node->values[i].b, sizeof(node->values[i].b), "b%u", i);
+    }
+    node->num_cells = num_cells;
+}
+
+// a full leaf in the page, which is dirty from now on
+void fill_leaf_page(uint32_t page_num, uint32_t num_cells) {
+    fill_leaf(get_page(page_num), num_cells);
+    mark_written(page_num);
+}
+
+// chain of `num_leaves` full leaves under one internal root
+void build_leaves(uint32_t num_leaves) {
+    fresh_table();
+    internal_node* root = get_page(table.root_page_num);
+    initialize_internal_node(root);
+    root->is_root = true;
+    uint32_t max_cells = table.leaf_node_max_cells;
+    for (uint32_t i = 0; i < num_leaves; i++) {
+        uint32_t page_num = get_unused_page_num();
+        leaf_node* leaf = get_page(page_num);
+        initialize_leaf_node(leaf);
+        fill_leaf(leaf, max_cells);
+        for (uint32_t j = 0; j < max_cells; j++) {
+            leaf->values[j].a += i * max_cells * 2;
+        }
+        leaf->parent = table.root_page_num;
+        leaf->next_leaf = i + 1 < num_leaves ? page_num + 1 : 0;
+        if (i + 1 < num_leaves) {
+            root->body[i].child = page_num;
+            root->body[i].key = leaf->values[max_cells - 1].a;
+        } else {
+            root->rightest_child = page_num;
+        }
+        mark_written(page_num);
+        root = get_page(table.root_page_num);
+    }
+    root->num_keys = num_leaves - 1;
+    mark_written(table.root_page_num);
+}
+
+void bench_leaf_node_find() {
+    fresh_table();
+    fill_leaf_page(table.root_page_num, table.leaf_node_max_cells);
+    uint32_t span = table.leaf_node_max_cells * 2;
+    uint64_t iterations = 2000000;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        Cursor* cursor = leaf_node_find(table.root_page_num, next_random() % span);
+        sink = cursor->cell_num;
+        free(cursor);
+    }
+    report("leaf_node_find", iterations, now_ns() - start);
+}
+
+void bench_internal_node_find_child() {
+    fresh_table();
+    internal_node* node = get_page(table.root_page_num);
+    initialize_internal_node(node);
+    uint32_t num_keys = table.internal_node_max_cells - 1;
+    for (uint32_t i = 0; i < num_keys; i++) {
+        node->body[i].child = i + 1;
+        node->body[i].key = i * 16 + 15;
+    }
+    node->num_keys = num_keys;
+    uint32_t span = num_keys * 16;
+    uint64_t iterations = 5000000;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink = internal_node_find_child(node, next_random() % span);
+    }
+    report("internal_node_find_child", iterations, now_ns() - start);
+}
+
+// half full leaf, each insert shifts the cells after a random position
+void bench_leaf_node_insert() {
+    fresh_table();
+    uint32_t page_num = table.root_page_num;
+    leaf_node* leaf = get_page(page_num);
+    uint32_t half = table.leaf_node_max_cells / 2;
+    fill_leaf(leaf, half);
+    Row row = {1, "row"};
+    Cursor cursor = {&table, page_num, 0, false};
+    uint64_t iterations = 2000000;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        cursor.cell_num = next_random() % (half + 1);
+        leaf_node_insert(&cursor, row.a, &row);
+        leaf->num_cells = half;
+    }
+    report("leaf_node_insert", iterations, now_ns() - start);
+}
+
+// full root leaf split in the middle, includes moving the root
+void bench_leaf_node_split_and_insert() {
+    uint64_t iterations = 2000, elapsed = 0;
+    Row row = {1, "row"};
+    for (uint64_t i = 0; i < iterations; i++) {
+        fresh_table();
+        uint32_t page_num = table.root_page_num;
+        fill_leaf_page(page_num, table.leaf_node_max_cells);
+        Cursor cursor = {&table, page_num, table.leaf_node_max_cells / 2,
+                         false};
+        row.a = table.leaf_node_max_cells + 1;
+        uint64_t start = now_ns();
+        leaf_node_split_and_insert(&cursor, row.a, &row);
+        elapsed += now_ns() - start;
+    }
+    report("leaf_node_split_and_insert", iterations, elapsed);
+}
+
+// full internal root split, includes re-parenting the moved children
+void bench_internal_node_split() {
+    uint32_t num_leaves = table.internal_node_max_cells + 1;
+    if (num_leaves + 4 > pager.num_frames) {
+        fprintf(stderr, "internal_node_split: %u children exceed the pager\n",
+                num_leaves);
+        return;
+    }
+    uint64_t iterations = 200, elapsed = 0;
+    for (uint64_t i = 0; i < iterations; i++) {
+        build_leaves(num_leaves);
+        uint64_t start = now_ns();
+        internal_node_split(table.root_page_num, 1);
+        elapsed += now_ns() - start;
+    }
+    report("internal_node_split", iterations, elapsed);
+}
+
+// per row, across leaf boundaries
+void bench_cursor_advance() {
+    uint32_t num_leaves = 256;
+    if (num_leaves > table.internal_node_max_cells) {
+        num_leaves = table.internal_node_max_cells;
+    }
+    build_leaves(num_leaves);
+    uint64_t iterations = 0;
+    uint64_t start = now_ns();
+    for (int round = 0; round < 20; round++) {
+        Cursor* cursor = table_start();
+        while (!cursor->is_end_of_table) {
+            cursor_advance(cursor);
+            iterations++;
+        }
+        free(cursor);
+    }
+    report("cursor_advance", iterations, now_ns() - start);
+}
+
+// hits: pages already in a frame, misses: frames dropped before each round
+void bench_get_page() {
+    uint32_t num_pages = pager.num_frames / 2;
+    fresh_table();
+    for (uint32_t i = 1; i < num_pages; i++) {
+        initialize_leaf_node(get_page(i));
+        mark_written(i);
+    }
+    db_close();
+    open_file(scratch_path, page_size, 0);
+
+    uint64_t iterations = 0, elapsed = 0;
+    for (int round = 0; round < 20; round++) {
+        drop_frames();
+        uint64_t start = now_ns();
+        for (uint32_t i = 1; i < num_pages; i++) {
+            sink = *(uint32_t*)get_page(i);
+        }
+        elapsed += now_ns() - start;
+        iterations += num_pages - 1;
+    }
+    report("get_page_miss", iterations, elapsed);
+
+    iterations = 10000000;
+    uint64_t start = now_ns();
+    for (uint64_t i = 0; i < iterations; i++) {
+        sink = *(uint32_t*)get_page(1 + next_random() % (num_pages - 1));
+    }
+    report("get_page_hit", iterations, now_ns() - start);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc == 3 && strcmp(argv[1], "--page-size") == 0) {
+        page_size = atoi(argv[2]);
+    }
+    int fd = mkstemp(scratch_path);
+    if (fd == -1) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    fresh_table();
+    bench_leaf_node_find();
+    bench_internal_node_find_child();
+    bench_leaf_node_insert();
+    bench_leaf_node_split_and_insert();
+    bench_internal_node_split();
+    bench_cursor_advance();
+    bench_get_page();
+
+    unlink(scratch_path);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,58 @@
+#!/bin/sh
+# Benchmark harness: one JSON object per scenario on stdout.
+#   load: insert BENCH_ROWS keys into an empty database
+#   mix:  run BENCH_OPS statements of each mix against a copy of the load
+# Scenarios where myjql fails are reported with "status":"failed".
+#
+# environment:
+#   BENCH_SIZES      table sizes, default "10000 100000"
+#   BENCH_KEYS       key orders, default "seq random"
+#   BENCH_MIXES      insert:select:delete weights, default "90:5:5 20:70:10"
+#   BENCH_OPS        statements per mix, default 1000
+#   BENCH_PAGE_SIZE  default 4096
+#   BENCH_ZIPF       theta of the b value distribution, default 0.99
+#   BENCH_ARGS       extra myjql arguments, e.g. "--compress 1"
+
+cd "$(dirname "$0")/.."
+MYJQL=./myjql
+WORKLOAD=bench/workload
+SIZES=${BENCH_SIZES:-"10000 100000"}
+KEYS=${BENCH_KEYS:-"seq random"}
+MIXES=${BENCH_MIXES:-"90:5:5 20:70:10"}
+OPS=${BENCH_OPS:-1000}
+PAGE_SIZE=${BENCH_PAGE_SIZE:-4096}
+ZIPF=${BENCH_ZIPF:-0.99}
+
+TMP=$(mktemp -d "${TMPDIR:-/tmp}/myjql-bench.XXXXXX")
+trap 'rm -rf "$TMP"' EXIT
+
+# run_scenario NAME DB SCRIPT: append the engine report to the scenario
+run_scenario() {
+    rm -f "$TMP/report.json"
+    $MYJQL --page-size "$PAGE_SIZE" $BENCH_ARGS --batch "$3" \
+        --report "$TMP/report.json" "$2" >/dev/null 2>"$TMP/stderr"
+    status=$?
+    if [ $status -eq 0 ] && [ -s "$TMP/report.json" ]; then
+        printf '{%s,"status":"ok",%s\n' "$1" "$(cut -c2- "$TMP/report.json")"
+    else
+        printf '{%s,"status":"failed","exit":%d}\n' "$1" "$status"
+    fi
+}
+
+for rows in $SIZES; do
+    for keys in $KEYS; do
+        common="\"rows\":$rows,\"keys\":\"$keys\",\"page_size\":$PAGE_SIZE,\"zipf\":$ZIPF"
+        $WORKLOAD --phase load --rows "$rows" --keys "$keys" --zipf "$ZIPF" \
+            >"$TMP/load.txt"
+        rm -f "$TMP/load.db"
+        run_scenario "\"phase\":\"load\",$common" "$TMP/load.db" "$TMP/load.txt"
+
+        for mix in $MIXES; do
+            $WORKLOAD --phase mix --rows "$rows" --ops "$OPS" --keys "$keys" \
+                --mix "$mix" --zipf "$ZIPF" >"$TMP/mix.txt"
+            cp "$TMP/load.db" "$TMP/mix.db" 2>/dev/null
+            run_scenario "\"phase\":\"mix\",\"mix\":\"$mix\",\"ops\":$OPS,$common" \
+                "$TMP/mix.db" "$TMP/mix.txt"
+        done
+    done
+done
@@ -0,0 +1,210 @@
+/* Workload generator for myjql, writes a statement script to stdout */
+/* Build: gcc -O2 -o bench/workload bench/workload.c -lm */
+/* Usage: bench/workload --phase load --rows 100000 --keys random > load.txt */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define OUTPUT_BUFFER_SIZE (1 << 20)
+
+typedef enum { KEYS_SEQUENTIAL, KEYS_RANDOM } KeyOrder;
+
+struct {
+    bool load;  // load phase inserts `rows` keys, mix phase runs `ops`
+    uint64_t rows;
+    uint64_t ops;
+    KeyOrder keys;
+    uint32_t mix[3];  // insert:select:delete weights
+    uint32_t b_values;
+    double zipf_theta;
+    uint64_t seed;
+} config = {true, 10000, 10000, KEYS_SEQUENTIAL, {90, 5, 5}, 1000, 0.99, 1};
+
+// xorshift64*, deterministic for a given --seed
+uint64_t rng_state;
+uint64_t next_random() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+double next_uniform() { return (next_random() >> 11) * (1.0 / 9007199254740992.0); }
+
+/*
+ *random order of the keys 0 .. rows-1 without a table: a Feistel network is
+ *a bijection on [0, 2^bits), values outside the range are walked again
+ */
+uint32_t feistel_bits;
+uint64_t feistel_keys[4];
+
+void permutation_init(uint64_t size) {
+    feistel_bits = 2;
+    while ((1ULL << feistel_bits) < size) {
+        feistel_bits += 2;
+    }
+    for (int i = 0; i < 4; i++) {
+        feistel_keys[i] = next_random();
+    }
+}
+
+uint64_t feistel(uint64_t value) {
+    uint32_t half = feistel_bits / 2;
+    uint64_t mask = (1ULL << half) - 1;
+    uint64_t left = value >> half, right = value & mask;
+    for (int i = 0; i < 4; i++) {
+        uint64_t f = ((right ^ feistel_keys[i]) * 0x9E3779B97F4A7C15ULL) >> 17;
+        uint64_t next = left ^ (f & mask);
+        left = right;
+        right = next;
+    }
+    return (left << half) | right;
+}
+
+uint64_t permute(uint64_t index, uint64_t size) {
+    uint64_t value = feistel(index);
+    while (value >= size) {
+        value = feistel(value);
+    }
+    return value;
+}
+
+/*
+ *Zipfian ranks of b: cumulative weights 1 / rank^theta, sampled by binary
+ *search, theta 0 is uniform
+ */
+double* zipf_cdf;
+
+void zipf_init() {
+    zipf_cdf = malloc(config.b_values * sizeof(double));
+    double sum = 0;
+    for (uint32_t i = 0; i < config.b_values; i++) {
+        sum += 1.0 / pow(i + 1, config.zipf_theta);
+        zipf_cdf[i] = sum;
+    }
+    for (uint32_t i = 0; i < config.b_values; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+uint32_t next_zipf() {
+    double u = next_uniform();
+    uint32_t left = 0, right = config.b_values - 1;
+    while (left < right) {
+        uint32_t mid = left + (right - left) / 2;
+        if (zipf_cdf[mid] < u) {
+            left = mid + 1;
+        } else {
+            right = mid;
+        }
+    }
+    return left;
+}
+
+char output[OUTPUT_BUFFER_SIZE];
+size_t output_length;
+
+void output_flush() {
+    fwrite(output, 1, output_length, stdout);
+    output_length = 0;
+}
+
+void emit(const char* keyword, bool with_key, uint64_t key, uint32_t b) {
+    if (output_length + 64 > OUTPUT_BUFFER_SIZE) {
+        output_flush();
+    }
+    if (with_key) {
+        output_length += sprintf(output + output_length, "%s %llu b%u\n",
+                                 keyword, (unsigned long long)key, b);
+    } else {
+        output_length +=
+            sprintf(output + output_length, "%s b%u\n", keyword, b);
+    }
+}
+
+// keys inserted during the mix phase are new: above the loaded range
+uint64_t next_new_key(uint64_t* inserted) {
+    uint64_t index = (*inserted)++;
+    if (config.keys == KEYS_SEQUENTIAL) {
+        return config.rows + index;
+    }
+    return config.rows + next_random() % (INT32_MAX - config.rows);
+}
+
+void print_usage() {
+    fprintf(stderr,
+            "Usage: workload [--phase load|mix] [--rows N] [--ops N]\n"
+            "                [--keys seq|random] [--mix I:S:D] [--b-values N]\n"
+            "                [--zipf THETA] [--seed N]\n");
+}
+
+int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            print_usage();
+            return EXIT_FAILURE;
+        } else if (strcmp(argv[i], "--phase") == 0) {
+            config.load = strcmp(value, "load") == 0;
+        } else if (strcmp(argv[i], "--rows") == 0) {
+            config.rows = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--ops") == 0) {
+            config.ops = strtoull(value, NULL, 10);
+        } else if (strcmp(argv[i], "--keys") == 0) {
+            config.keys =
+                strcmp(value, "random") == 0 ? KEYS_RANDOM : KEYS_SEQUENTIAL;
+        } else if (strcmp(argv[i], "--mix") == 0) {
+            if (sscanf(value, "%u:%u:%u", &config.mix[0], &config.mix[1],
+                       &config.mix[2]) != 3) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[i], "--b-values") == 0) {
+            config.b_values = strtoul(value, NULL, 10);
+        } else if (strcmp(argv[i], "--zipf") == 0) {
+            config.zipf_theta = strtod(value, NULL);
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            config.seed = strtoull(value, NULL, 10);
+        } else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+        i++;
+    }
+    if (config.rows > INT32_MAX || config.b_values == 0 ||
+        config.mix[0] + config.mix[1] + config.mix[2] == 0) {
+        print_usage();
+        return EXIT_FAILURE;
+    }
+
+    rng_state = config.seed * 0x9E3779B97F4A7C15ULL + 1;
+    zipf_init();
+
+    if (config.load) {
+        permutation_init(config.rows);
+        for (uint64_t i = 0; i < config.rows; i++) {
+            uint64_t key = config.keys == KEYS_SEQUENTIAL
+                               ? i
+                               : permute(i, config.rows);
+            emit("insert", true, key, next_zipf());
+        }
+    } else {
+        uint32_t total = config.mix[0] + config.mix[1] + config.mix[2];
+        uint64_t inserted = 0;
+        for (uint64_t i = 0; i < config.ops; i++) {
+            uint32_t pick = next_random() % total;
+            if (pick < config.mix[0]) {
+                emit("insert", true, next_new_key(&inserted), next_zipf());
+            } else if (pick < config.mix[0] + config.mix[1]) {
+                emit("select", false, 0, next_zipf());
+            } else {
+                emit("delete", false, 0, next_zipf());
+            }
+        }
+    }
+    output_flush();
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,90 @@
+#ifndef LIBMYJQL_H
+#define LIBMYJQL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ *embedding API of the myjql engine, built as libmyjql.a and libmyjql.so
+ *statements use the shell's syntax with `?` in place of a or b, values are
+ *bound in binary, rows are handed back as pointers into the leaf pages
+ *the engine state is per process: one database can be open at a time and
+ *the handles must not be used from more than one thread at once
+ *":memory:" as the filename keeps the table in memory only
+ *a select that is being stepped, from its first row until it is done,
+ *reset or finalized, holds back the background merge and makes writes
+ *return MYJQL_BUSY: its position in the tree and the memtables stays valid
+ */
+
+#define COLUMN_B_SIZE 11
+
+// a row as stored in a leaf, b is zero padded
+typedef struct {
+    uint32_t a;
+    char b[COLUMN_B_SIZE + 1];
+} leaf_node_body;
+
+typedef struct myjql myjql;
+typedef struct myjql_stmt myjql_stmt;
+
+typedef enum {
+    MYJQL_OK,
+    MYJQL_ROW,     // myjql_step has a row
+    MYJQL_DONE,    // myjql_step has finished the statement
+    MYJQL_ERROR,   // see myjql_errmsg
+    MYJQL_BUSY,    // a database is already open, or a write while a select
+                   // is being stepped
+    MYJQL_RANGE,   // value does not fit its column or parameter index
+    MYJQL_MISUSE   // step with a parameter that is not bound
+} myjql_result;
+
+// how rows are assigned to the files of a partitioned table
+typedef enum { MYJQL_PARTITION_HASH, MYJQL_PARTITION_RANGE } myjql_partitioning;
+
+// 0 fields take the defaults of the shell
+typedef struct {
+    uint32_t page_size;    // only used when the file is created
+    int compression;       // like --compress, 0 keeps the file's setting
+    uint32_t cache_pages;  // frames in the buffer pool, shared by partitions
+    uint32_t partitions;   // files of a new table, by hash or range of a
+    myjql_partitioning partition_by;
+    uint32_t memtable_rows;  // like --memtable, 0 writes inserts to the tree
+    uint32_t dirty_target;   // like --dirty-target, percent of the frames
+    uint32_t checkpoint_ms;  // like --checkpoint, 0: only on close
+    int direct_io;           // like --direct-io, uncompressed files only
+    // with ":memory:" as the filename, a .snapshot image to start from
+    const char* snapshot;
+} myjql_options;
+
+#if defined(__GNUC__)
+#define MYJQL_API __attribute__((visibility("default")))
+#else
+#define MYJQL_API
+#endif
+
+// `options` may be NULL, a file that cannot be opened or is not a myjql
+// database ends the process with a message, as in the shell
+MYJQL_API int myjql_open(const char* filename, const myjql_options* options,
+                         myjql** db);
+// flushes dirty pages and closes the file, statements must be finalized
+MYJQL_API int myjql_close(myjql* db);
+MYJQL_API const char* myjql_errmsg(myjql* db);
+// rows inserted, replaced or deleted by the last statement
+MYJQL_API uint64_t myjql_changes(myjql* db);
+
+// `insert ? ?`, `upsert ? ?`, `select ?`, `select count(*) ?`, `delete ?` ...
+// `explain`, `group by` and `order by` are only available in the shell
+MYJQL_API int myjql_prepare(myjql* db, const char* sql, myjql_stmt** stmt);
+MYJQL_API int myjql_bind_a(myjql_stmt* stmt, uint32_t a);
+// `length` bytes of `b`, at most COLUMN_B_SIZE
+MYJQL_API int myjql_bind_b(myjql_stmt* stmt, const char* b, size_t length);
+// MYJQL_ROW for every row of a select, aggregates return one row with the
+// value in a and an empty b, MYJQL_DONE at the end and for writes
+MYJQL_API int myjql_step(myjql_stmt* stmt);
+// current row, valid until the next call on any statement of the database
+MYJQL_API const leaf_node_body* myjql_row(myjql_stmt* stmt);
+// run the statement again from the start, bindings are kept
+MYJQL_API int myjql_reset(myjql_stmt* stmt);
+MYJQL_API void myjql_finalize(myjql_stmt* stmt);
+
+#endif
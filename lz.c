@@ -0,0 +1,197 @@
+#include "lz.h"
+
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5
+#define LZ_MF_LIMIT 12
+#define LZ_MAX_DISTANCE 65535
+#define LZ_RUN_MASK 15
+
+static uint32_t lz_read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t sequence) {
+    return (sequence * 2654435761U) >> (32 - LZ_HASH_LOG);
+}
+
+// lengths >= 15 continue in extra bytes of 255
+static uint8_t* lz_write_length(uint8_t* op, uint32_t length) {
+    while (length >= 255) {
+        *op++ = 255;
+        length -= 255;
+    }
+    *op++ = (uint8_t)length;
+    return op;
+}
+
+static uint8_t* lz_write_sequence(uint8_t* op, const uint8_t* anchor,
+                                  uint32_t literal_length, uint32_t offset,
+                                  uint32_t match_length) {
+    uint8_t* token = op++;
+    if (literal_length >= LZ_RUN_MASK) {
+        *token = LZ_RUN_MASK << 4;
+        op = lz_write_length(op, literal_length - LZ_RUN_MASK);
+    } else {
+        *token = literal_length << 4;
+    }
+    memcpy(op, anchor, literal_length);
+    op += literal_length;
+    if (match_length == 0) {
+        // last sequence has literals only
+        return op;
+    }
+    *op++ = offset & 0xFF;
+    *op++ = offset >> 8;
+    match_length -= LZ_MIN_MATCH;
+    if (match_length >= LZ_RUN_MASK) {
+        *token |= LZ_RUN_MASK;
+        op = lz_write_length(op, match_length - LZ_RUN_MASK);
+    } else {
+        *token |= match_length;
+    }
+    return op;
+}
+
+int lz_compress(const void* src, int src_size, void* dst, int dst_capacity,
+                int level, void* workspace) {
+    const uint8_t* base = src;
+    const uint8_t* ip = base;
+    const uint8_t* anchor = base;
+    const uint8_t* end = base + src_size;
+    const uint8_t* mf_limit = end - LZ_MF_LIMIT;
+    const uint8_t* match_limit = end - LZ_LAST_LITERALS;
+    uint8_t* op = dst;
+    uint8_t* op_end = op + dst_capacity;
+
+    int32_t* head = workspace;
+    uint16_t* chain = (uint16_t*)(head + (1 << LZ_HASH_LOG));
+    uint32_t max_attempts = 1;
+    if (level > LZ_MIN_LEVEL) {
+        max_attempts = 1u << (level - 1);
+    }
+
+    if (src_size > LZ_MAX_INPUT_SIZE) {
+        return 0;
+    }
+    memset(head, -1, (1 << LZ_HASH_LOG) * sizeof(int32_t));
+
+    while (src_size > LZ_MF_LIMIT && ip < mf_limit) {
+        int32_t pos = ip - base;
+        uint32_t sequence = lz_read32(ip);
+        uint32_t h = lz_hash(sequence);
+
+        // walk the chain for the longest match
+        uint32_t best_length = 0;
+        int32_t best_pos = 0;
+        int32_t candidate = head[h];
+        uint32_t attempts = max_attempts;
+        while (candidate >= 0 && pos - candidate <= LZ_MAX_DISTANCE &&
+               attempts-- > 0) {
+            if (lz_read32(base + candidate) == sequence) {
+                uint32_t length = LZ_MIN_MATCH;
+                while (ip + length < match_limit &&
+                       ip[length] == base[candidate + length]) {
+                    length++;
+                }
+                if (length > best_length) {
+                    best_length = length;
+                    best_pos = candidate;
+                }
+            }
+            uint16_t delta = chain[candidate];
+            if (delta == 0) {
+                break;
+            }
+            candidate -= delta;
+        }
+        chain[pos] = (head[h] >= 0 && pos - head[h] <= LZ_MAX_DISTANCE)
+                         ? pos - head[h]
+                         : 0;
+        head[h] = pos;
+
+        if (best_length < LZ_MIN_MATCH) {
+            // level 1 skips faster through incompressible data
+            ip += (level <= LZ_MIN_LEVEL) ? 1 + ((ip - anchor) >> 6) : 1;
+            continue;
+        }
+
+        uint32_t literal_length = ip - anchor;
+        if (op + 1 + literal_length + literal_length / 255 + 2 +
+                best_length / 255 + 1 >
+            op_end) {
+            return 0;
+        }
+        op = lz_write_sequence(op, anchor, literal_length, pos - best_pos,
+                               best_length);
+        ip += best_length;
+        anchor = ip;
+    }
+
+    uint32_t literal_length = end - anchor;
+    if (op + 1 + literal_length + literal_length / 255 + 1 > op_end) {
+        return 0;
+    }
+    op = lz_write_sequence(op, anchor, literal_length, 0, 0);
+    return op - (uint8_t*)dst;
+}
+
+int lz_decompress(const void* src, int src_size, void* dst, int dst_capacity) {
+    const uint8_t* ip = src;
+    const uint8_t* ip_end = ip + src_size;
+    uint8_t* op = dst;
+    uint8_t* op_end = op + dst_capacity;
+
+    while (ip < ip_end) {
+        uint8_t token = *ip++;
+        uint32_t literal_length = token >> 4;
+        if (literal_length == LZ_RUN_MASK) {
+            uint8_t b;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                literal_length += b;
+            } while (b == 255);
+        }
+        if (literal_length > (uint32_t)(ip_end - ip) ||
+            literal_length > (uint32_t)(op_end - op)) {
+            return -1;
+        }
+        memcpy(op, ip, literal_length);
+        op += literal_length;
+        ip += literal_length;
+        if (ip >= ip_end) {
+            break;
+        }
+
+        if (ip_end - ip < 2) return -1;
+        uint32_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (uint32_t)(op - (uint8_t*)dst)) {
+            return -1;
+        }
+        uint32_t match_length = token & LZ_RUN_MASK;
+        if (match_length == LZ_RUN_MASK) {
+            uint8_t b;
+            do {
+                if (ip >= ip_end) return -1;
+                b = *ip++;
+                match_length += b;
+            } while (b == 255);
+        }
+        match_length += LZ_MIN_MATCH;
+        if (match_length > (uint32_t)(op_end - op)) {
+            return -1;
+        }
+        // byte by byte, the match may overlap the output
+        const uint8_t* ref = op - offset;
+        for (uint32_t i = 0; i < match_length; i++) {
+            op[i] = ref[i];
+        }
+        op += match_length;
+    }
+    return op - (uint8_t*)dst;
+}
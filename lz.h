@@ -0,0 +1,28 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+/*
+ *LZ77 block codec, output follows the LZ4 block format
+ *(token, literals, 2-byte offset, match length; last 5 bytes are literals)
+ *inputs are limited to 64 KiB, which is the largest page size
+ */
+
+#define LZ_MAX_INPUT_SIZE 65536
+#define LZ_MIN_LEVEL 1
+#define LZ_MAX_LEVEL 9
+#define LZ_HASH_LOG 12
+// hash heads followed by the match chain, indexed by position
+#define LZ_WORKSPACE_SIZE \
+    ((1 << LZ_HASH_LOG) * sizeof(int32_t) + LZ_MAX_INPUT_SIZE * sizeof(uint16_t))
+#define lz_compress_bound(size) ((size) + (size) / 255 + 16)
+
+// compress `src` into `dst`, higher level searches longer match chains
+// return compressed size, 0 if it does not fit in `dst_capacity`
+int lz_compress(const void* src, int src_size, void* dst, int dst_capacity,
+                int level, void* workspace);
+// return decompressed size, -1 if `src` is malformed
+int lz_decompress(const void* src, int src_size, void* dst, int dst_capacity);
+
+#endif
@@ -3,17 +3,35 @@
                                                                  -O3 */
 /* Test: /usr/bin/time -v ./myjql myjql.db < in.txt > out.txt */
 /* Compare: diff out.txt ans.txt */
+/* Benchmark: make bench, make microbench */
+
+// O_DIRECT
+#define _GNU_SOURCE
 
 #include "myjql.h"
+#include "lz.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 // print memory by hex, used for debugging
 void print_bytes(void* ptr, int size) {
@@ -39,13 +57,122 @@ const uint32_t ROW_SIZE = 16;
 Pager pager;
 Table table;
 
+// the files of a partitioned table, see partition_use()
+#define MAX_PARTITIONS 64
+typedef struct Partition Partition;
+struct {
+    uint32_t count;
+    myjql_partitioning scheme;
+    uint32_t current;  // the one in `pager` and `table`
+    Partition* parts;  // NULL for a single file
+} partitions = {1};
+
+/*
+ *memtable: with --memtable ROWS inserts go to a sorted in-memory skiplist
+ *instead of a leaf; a full memtable becomes immutable and a merger thread
+ *inserts its rows into the B+tree in key order, so every leaf is read and
+ *written once for all the rows that land in it instead of once per row
+ *reads combine the tree with both memtables, `delete` marks matching
+ *memtable rows deleted (rows are deleted by b, never by key)
+ *the merger and the statements take turns on engine_lock
+ */
+#define MEMTABLE_MAX_HEIGHT 16
+#define MEMTABLE_MAX_ROWS (1 << 26)
+// rows merged per hold of the engine lock
+#define MEMTABLE_MERGE_SLICE 256
+typedef struct {
+    Row row;
+    bool deleted;
+    bool merged;
+    uint32_t next[MEMTABLE_MAX_HEIGHT];  // by level, 0: end of the list
+} memtable_entry;
+typedef struct {
+    memtable_entry* entries;  // entries[0] is the head
+    uint32_t size;            // entries in use, the head included
+    uint32_t height;
+    uint32_t merge_next;  // next entry the merger inserts, 0 when done
+} Memtable;
+struct {
+    uint32_t capacity;  // rows per memtable, 0: inserts go to the tree
+    Memtable tables[2];
+    Memtable* active;
+    Memtable* immutable;  // being merged, NULL when there is none
+    uint32_t pinned;      // library selects between steps, merging waits
+                          // and writes are refused
+    bool stopping;
+    pthread_t merger;
+    pthread_cond_t changed;
+    uint64_t rows_merged;
+    uint64_t stalls;  // a full memtable waited for the previous merge
+} memtable = {.changed = PTHREAD_COND_INITIALIZER};
+pthread_mutex_t engine_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ *flusher: a thread that writes dirty frames back in page order while more
+ *than dirty_target percent of a pager's frames are dirty, so the clock
+ *sweep finds clean victims, and writes all of them every checkpoint_ms
+ *so closing has little left to write
+ */
+// pages written per hold of the engine lock
+#define FLUSHER_BATCH 32
+#define FLUSHER_TICK_MS 10
+struct {
+    bool running;
+    bool stopping;
+    uint32_t dirty_target;   // percent, 0: only checkpoints
+    uint32_t checkpoint_ms;  // 0: no checkpoints
+    pthread_t thread;
+    pthread_cond_t wake;
+    uint64_t pages_written;
+    uint64_t checkpoints;
+    uint64_t eviction_writes;  // dirty victims written by the clock sweep
+} flusher = {.wake = PTHREAD_COND_INITIALIZER};
+
+/*
+ *always-on counters of the hot paths, shown by .stats and written as JSON
+ *at exit with --stats
+ */
+#define STATS_MAX_HEIGHT 16
+struct {
+    uint64_t cursors;                   // allocated by leaf_node_find
+    uint64_t splits[STATS_MAX_HEIGHT];  // by level, leaves are level 0
+    uint64_t root_splits;
+    // per StatementType
+    uint64_t count[3];
+    uint64_t cycles[3];
+    uint64_t rows_scanned[3];
+    uint64_t rows_emitted[3];  // returned, inserted or deleted
+    // --serve requests, kept apart from the statements: they are not timed
+    uint64_t requests[3];
+    uint64_t request_rows_scanned[3];
+    const char* path;  // --stats
+    // explain analyze: distinct pages visited by one statement
+    uint8_t* touched;  // by page_num, NULL when not tracking
+    uint32_t touched_capacity;
+    uint64_t pages_touched;
+    uint64_t leaves_skipped;  // by the b summaries
+} stats;
+
+// time stamp counter, nanoseconds where there is none
+static inline uint64_t read_cycles() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
 /*
  *functions declartions
  */
 Cursor* internal_node_find(uint32_t page_num, uint32_t key);
 uint32_t internal_node_find_child(internal_node* node, uint32_t key);
 
-void pager_open(const char* filename);
+void pager_open(const char* filename, uint32_t page_size, int compression);
+void pager_find_free_slots();
+void pager_release_slot(page_location* location, bool durable);
 void print_row(Row* row);
 Cursor* table_find(uint32_t key);
 Cursor* table_start();
@@ -70,12 +197,6 @@ uint32_t* leaf_node_next_leaf(void* node);
 uint32_t* leaf_node_cell(void* node, uint32_t cell_num);
 uint32_t* leaf_node_key(void* node, uint32_t key_num);
 
-void update_internal_node_key(internal_node* node, uint32_t old_key,
-                              uint32_t new_key) {
-    uint32_t old_child_index = internal_node_find_child(node, old_key);
-    node->body[old_child_index].key = new_key;
-}
-
 // REBORN!
 
 /*
@@ -114,43 +235,289 @@ const uint32_t LEAF_NODE_KEY_OFFSET = 0;
 const uint32_t LEAF_NODE_VALUE_SIZE = 12;
 const uint32_t LEAF_NODE_VALUE_OFFSET = 4;
 const uint32_t LEAF_NODE_CELL_SIZE = 16;
-const uint32_t LEAF_NODE_SPACE_FOR_CELLS = 4076;
 
-/*const uint32_t LEAF_NODE_MAX_CELLS =*/
-/*LEAF_NODE_SPACE_FOR_CELLS / LEAF_NODE_CELL_SIZE;*/
+// derive node capacities from page size
 // Right and left node numbers AFTER splitting
+void table_set_page_size(uint32_t page_size) {
+    uint32_t leaf_node_space_for_cells = page_size - LEAF_NODE_HEADER_SIZE;
+    uint32_t internal_node_space_for_cells =
+        page_size - INTERNAL_NODE_HEADER_SIZE;
+
+    table.leaf_node_max_cells = leaf_node_space_for_cells / LEAF_NODE_CELL_SIZE;
+    table.leaf_node_right_split_count = (table.leaf_node_max_cells + 1) / 2;
+    table.leaf_node_left_split_count =
+        (table.leaf_node_max_cells + 1) - table.leaf_node_right_split_count;
+
+    // an internal node is split once it holds max cells keys, the middle key
+    // moves up and the rest are shared by the two halves
+    table.internal_node_max_cells =
+        internal_node_space_for_cells / INTERNAL_NODE_CELL_SIZE;
+    table.internal_node_left_split_size = table.internal_node_max_cells / 2;
+    table.internal_node_right_split_size = table.internal_node_max_cells -
+                                           table.internal_node_left_split_size -
+                                           1;
+}
 
 /* shell IO */
 
 #define INPUT_BUFFER_SIZE 31
+// modifier words such as `explain analyze ` do not count against the limit
+#define INPUT_LINE_MAX                                                \
+    (INPUT_BUFFER_SIZE +                                              \
+     sizeof("explain analyze or replace order by b limit ") - 1)
+const char* input_modifiers[] = {"explain ",   "analyze ", "or ignore ",
+                                 "or replace ", "order by b", "limit "};
+#define INPUT_CHUNK_SIZE (1 << 20)
+// current line, points into input_reader's data (not copied)
 struct {
-    char buffer[INPUT_BUFFER_SIZE + 1];
+    char* buffer;
     size_t length;
 } input_buffer;
 
-typedef enum { INPUT_SUCCESS, INPUT_TOO_LONG } InputResult;
+// stdin is mmap'd when it is a regular file, otherwise read in large chunks
+struct {
+    char* data;
+    size_t start;  // first byte not consumed yet
+    size_t end;    // end of valid data
+    size_t capacity;
+    bool eof;
+    // last line without new-line, a mapped file has no room for the '\0'
+    char last_line[INPUT_LINE_MAX + 1];
+} input_reader;
+
+typedef enum { INPUT_SUCCESS, INPUT_TOO_LONG, INPUT_EOF } InputResult;
+
+/*
+ *result sink: everything the shell prints goes through one large buffer,
+ *written with write(2) when full and before blocking on input
+ */
+#define OUTPUT_BUFFER_SIZE (1 << 16)
+typedef enum { OUTPUT_TEXT, OUTPUT_CSV, OUTPUT_BINARY } OutputMode;
+struct {
+    char buffer[OUTPUT_BUFFER_SIZE];
+    size_t length;
+    OutputMode mode;
+    // no prompts, blank lines or "Executed.", diagnostics go to stderr
+    bool quiet;
+    // explain analyze runs statements without printing their rows
+    bool discard_rows;
+} output;
+
+void output_flush() {
+    size_t written = 0;
+    while (written < output.length) {
+        ssize_t n = write(STDOUT_FILENO, output.buffer + written,
+                          output.length - written);
+        if (n <= 0) {
+            break;
+        }
+        written += n;
+    }
+    output.length = 0;
+}
+
+void output_write(const void* data, size_t length) {
+    if (output.length + length > OUTPUT_BUFFER_SIZE) {
+        output_flush();
+    }
+    memcpy(output.buffer + output.length, data, length);
+    output.length += length;
+}
+
+void output_string(const char* string) { output_write(string, strlen(string)); }
+
+// hand-rolled, no format string parsing per row
+void output_uint32(uint32_t value) {
+    char digits[10];
+    int i = sizeof(digits);
+    do {
+        digits[--i] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    output_write(digits + i, sizeof(digits) - i);
+}
+
+// prompts and separators of the interactive shell
+void output_decoration(const char* string) {
+    if (!output.quiet) {
+        output_string(string);
+    }
+}
+
+// diagnostics: stderr under --quiet, else in line with the results
+void output_message(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (output.quiet) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        return;
+    }
+    char message[256];
+    va_list retry;
+    va_copy(retry, args);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    if (length >= (int)sizeof(message)) {
+        char* long_message = malloc(length + 1);
+        vsnprintf(long_message, length + 1, format, retry);
+        // in pieces the sink can hold
+        for (int i = 0; i < length; i += OUTPUT_BUFFER_SIZE) {
+            output_write(long_message + i, length - i < OUTPUT_BUFFER_SIZE
+                                               ? length - i
+                                               : OUTPUT_BUFFER_SIZE);
+        }
+        free(long_message);
+    } else if (length > 0) {
+        output_write(message, length);
+    }
+    va_end(retry);
+    va_end(args);
+}
+
+void print_prompt() { output_decoration("myjql> "); }
+
+void input_open() {
+    struct stat st;
+    if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0) {
+        // private mapping, lines are terminated in place
+        void* data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, STDIN_FILENO, 0);
+        off_t offset = lseek(STDIN_FILENO, 0, SEEK_CUR);
+        if (data != MAP_FAILED) {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            input_reader.data = data;
+            input_reader.start = offset > 0 ? offset : 0;
+            input_reader.end = st.st_size;
+            input_reader.capacity = st.st_size;
+            input_reader.eof = true;
+            return;
+        }
+    }
+    input_reader.capacity = INPUT_CHUNK_SIZE;
+    input_reader.data = malloc(input_reader.capacity);
+    input_reader.start = 0;
+    input_reader.end = 0;
+    input_reader.eof = false;
+}
+
+// move the unfinished line to the front and read another chunk
+bool input_fill() {
+    if (input_reader.eof) {
+        return false;
+    }
+    size_t pending = input_reader.end - input_reader.start;
+    memmove(input_reader.data, input_reader.data + input_reader.start,
+            pending);
+    input_reader.start = 0;
+    input_reader.end = pending;
+    // whoever feeds us may be waiting for the previous results
+    output_flush();
+    ssize_t bytes_read = read(STDIN_FILENO, input_reader.data + pending,
+                              input_reader.capacity - pending);
+    if (bytes_read <= 0) {
+        input_reader.eof = true;
+        return false;
+    }
+    input_reader.end += bytes_read;
+    return true;
+}
 
-void print_prompt() { printf("myjql> "); }
+// `line` is not terminated yet
+bool input_fits(const char* line, size_t length) {
+    if (length <= INPUT_BUFFER_SIZE) {
+        return true;
+    }
+    if (length > INPUT_LINE_MAX) {
+        return false;
+    }
+    size_t modifiers = 0;
+    const char* end = line + length;
+    const char* p = line;
+    while (p < end) {
+        bool matched = false;
+        for (int i = 0; i < sizeof(input_modifiers) / sizeof(char*); i++) {
+            size_t n = strlen(input_modifiers[i]);
+            if (end - p >= n && strncmp(p, input_modifiers[i], n) == 0) {
+                modifiers += n;
+                p += n;
+                matched = true;
+                break;
+            }
+        }
+        if (!matched) {
+            while (p < end && *p != ' ') p++;
+            while (p < end && *p == ' ') p++;
+        }
+    }
+    return length - modifiers <= INPUT_BUFFER_SIZE;
+}
 
 InputResult read_input() {
     /* we read the entire line as the input */
-    input_buffer.length = 0;
-    while (input_buffer.length <= INPUT_BUFFER_SIZE &&
-           (input_buffer.buffer[input_buffer.length++] = getchar()) != '\n' &&
-           input_buffer.buffer[input_buffer.length - 1] != EOF)
-        ;
-    if (input_buffer.buffer[input_buffer.length - 1] == EOF) exit(EXIT_SUCCESS);
-    input_buffer.length--;
-    /* if the last character is not new-line, the input is considered too
-       long, the remaining characters are discarded */
-    if (input_buffer.length == INPUT_BUFFER_SIZE &&
-        input_buffer.buffer[input_buffer.length] != '\n') {
-        while (getchar() != '\n')
-            ;
-        return INPUT_TOO_LONG;
-    }
-    input_buffer.buffer[input_buffer.length] = 0;
-    return INPUT_SUCCESS;
+    bool too_long = false;
+    while (1) {
+        char* line = input_reader.data + input_reader.start;
+        size_t available = input_reader.end - input_reader.start;
+        char* newline = memchr(line, '\n', available);
+        if (newline != NULL) {
+            size_t length = newline - line;
+            input_reader.start += length + 1;
+            /* if the line does not fit, the input is considered too
+               long, the remaining characters are discarded */
+            if (too_long || !input_fits(line, length)) {
+                return INPUT_TOO_LONG;
+            }
+            *newline = 0;
+            input_buffer.buffer = line;
+            input_buffer.length = length;
+            return INPUT_SUCCESS;
+        }
+        if (!input_reader.eof && available == input_reader.capacity) {
+            // no new-line in a full buffer, drop it
+            too_long = true;
+            input_reader.start = input_reader.end;
+        }
+        if (!input_fill()) {
+            line = input_reader.data + input_reader.start;
+            available = input_reader.end - input_reader.start;
+            if (available == 0 && !too_long) return INPUT_EOF;
+            input_reader.start = input_reader.end;
+            if (too_long || !input_fits(line, available)) {
+                return INPUT_TOO_LONG;
+            }
+            memcpy(input_reader.last_line, line, available);
+            input_reader.last_line[available] = 0;
+            input_buffer.buffer = input_reader.last_line;
+            input_buffer.length = available;
+            return INPUT_SUCCESS;
+        }
+    }
+}
+
+// a word of the current line, not terminated
+typedef struct {
+    const char* start;
+    uint32_t length;
+} Token;
+
+// zero-copy tokenizer, advance `cursor` past the next space separated word
+bool next_token(const char** cursor, Token* token) {
+    const char* p = *cursor;
+    while (*p == ' ') p++;
+    if (*p == 0) {
+        return false;
+    }
+    token->start = p;
+    while (*p != ' ' && *p != 0) p++;
+    token->length = p - token->start;
+    *cursor = p;
+    return true;
+}
+
+bool token_equals(Token* token, const char* word) {
+    return strncmp(token->start, word, token->length) == 0 &&
+           word[token->length] == 0;
 }
 
 /*
@@ -161,91 +528,621 @@ uint32_t get_unused_page_num() {
     // TODO: recycle free pages, LRU algo, page pool
 }
 
-void mark_written(uint32_t page_num) { pager.pages[page_num].written = true; }
+// the page was changed through the pointer get_page returned, which is only
+// valid while the page is in the pool
+void mark_written(uint32_t page_num) {
+    if (pager.in_memory) {
+        return;
+    }
+    if (page_num >= pager.frame_of_capacity || pager.frame_of[page_num] < 0) {
+        fprintf(stderr, "Page %u is not in the buffer pool.\n", page_num);
+        exit(EXIT_FAILURE);
+    }
+    Page* page = &pager.pages[pager.frame_of[page_num]];
+    if (!page->written) {
+        page->written = true;
+        pager.dirty++;
+        if (flusher.dirty_target > 0 &&
+            pager.dirty * 100 > pager.num_frames * flusher.dirty_target) {
+            pthread_cond_signal(&flusher.wake);
+        }
+    }
+}
+
+// pread until `length` bytes are in, short only at the end of the file
+// return the bytes read, -1 on error
+ssize_t pread_full(int fd, void* buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pread(fd, (char*)buffer + done, length - done,
+                          offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
 
-// get one page by page_num
-void* get_page(uint32_t page_num) {
-    bool flag = false;
-    uint32_t original = page_num;
-    int resid = 0;
-    if (page_num > TABLE_MAX_PAGES) {
-        // FIXME: handle more pages than boundary
-        flag = true;
-        resid = page_num / PAGE_MOD;
-        page_num = page_num % PAGE_MOD;
-    }
-    if (pager.pages[page_num].storage == NULL) {
-        // if no cache, read from disk
-        void* page = malloc(PAGE_SIZE);
-        uint32_t num_pages = pager.file_length / PAGE_SIZE;
-        if (pager.file_length % PAGE_SIZE) {
-            num_pages += 1;
-        }
-
-        if (page_num <= num_pages) {
-            lseek(pager.file_descriptor, original * PAGE_SIZE, SEEK_SET);
-            ssize_t bytes_read = read(pager.file_descriptor, page, PAGE_SIZE);
-            if (bytes_read == -1) {
-                // FIXME: handle reading failure
+// pwrite all `length` bytes, return false on error
+bool pwrite_full(int fd, const void* buffer, size_t length, off_t offset) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = pwrite(fd, (const char*)buffer + done, length - done,
+                           offset + done);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// a page that cannot be read or written ends the process, a statement
+// must never go on with a page that is not what the file holds
+void pager_io_failed(const char* action, uint32_t page_num) {
+    fprintf(stderr, "Error %s page %u: %s\n", action, page_num,
+            errno != 0 ? strerror(errno) : "end of file");
+    exit(EXIT_FAILURE);
+}
+
+// read a page image from disk, pages never written read as zeros
+void pager_read_page(uint32_t page_num, void* page) {
+    if (pager.compression && page_num != DB_HEADER_PAGE_NUM) {
+        page_location* location = NULL;
+        if (page_num < pager.locations_capacity) {
+            location = &pager.locations[page_num];
+        }
+        if (location == NULL || location->length == 0) {
+            memset(page, 0, pager.page_size);
+            return;
+        }
+        pager.pages_read++;
+        errno = 0;
+        if (location->length == pager.page_size) {
+            if (pread_full(pager.file_descriptor, page, pager.page_size,
+                           location->offset) != pager.page_size) {
+                pager_io_failed("reading", page_num);
             }
+            return;
+        }
+        if (pread_full(pager.file_descriptor, pager.compress_buffer,
+                       location->length,
+                       location->offset) != location->length) {
+            pager_io_failed("reading", page_num);
         }
-        pager.pages[page_num].page_num = original;
-        pager.pages[page_num].written = false;
-        pager.pages[page_num].storage = page;
-        if (page_num >= pager.num_pages) {
-            pager.num_pages = page_num + 1;
+        int size = lz_decompress(pager.compress_buffer, location->length, page,
+                                 pager.page_size);
+        if (size != pager.page_size) {
+            fprintf(stderr, "Page %d is corrupt.\n", page_num);
+            exit(EXIT_FAILURE);
+        }
+        return;
+    }
+
+    uint32_t num_pages = pager.file_length / pager.page_size;
+    if (pager.file_length % pager.page_size) {
+        num_pages += 1;
+    }
+    if (page_num < num_pages) {
+        pager.pages_read++;
+        errno = 0;
+        if (pread_full(pager.file_descriptor, page, pager.page_size,
+                       (off_t)page_num * pager.page_size) != pager.page_size) {
+            pager_io_failed("reading", page_num);
         }
-        return pager.pages[page_num].storage;
     } else {
-        if (pager.pages[page_num].page_num == original) {
-            return pager.pages[page_num].storage;
-        } else {
-            // hit another page, clean and reget
-            if (pager.pages[page_num].written) {
-                pager_flush(page_num);
-            }
-            void* page = malloc(PAGE_SIZE);
-            uint32_t num_pages = pager.file_length / PAGE_SIZE;
-            if (pager.file_length % PAGE_SIZE) {
-                num_pages += 1;
-            }
-            if (page_num <= num_pages) {
-                lseek(pager.file_descriptor, original * PAGE_SIZE, SEEK_SET);
-                ssize_t bytes_read =
-                    read(pager.file_descriptor, page, PAGE_SIZE);
-                if (bytes_read == -1) {
-                    // FIXME: handle reading failure
-                }
-            }
-            pager.pages[page_num].page_num = original;
-            pager.pages[page_num].written = false;
-            pager.pages[page_num].storage = page;
-            if (page_num >= pager.num_pages) {
-                pager.num_pages = page_num + 1;
+        // the frame still holds the page it was taken from
+        memset(page, 0, pager.page_size);
+    }
+}
+
+void stats_touch(uint32_t page_num) {
+    // pages of all partitions share the bitmap
+    page_num = page_num * partitions.count + partitions.current;
+    if (page_num >= stats.touched_capacity) {
+        uint32_t capacity = page_num * 2 + 64;
+        stats.touched = realloc(stats.touched, capacity);
+        memset(stats.touched + stats.touched_capacity, 0,
+               capacity - stats.touched_capacity);
+        stats.touched_capacity = capacity;
+    }
+    if (!stats.touched[page_num]) {
+        stats.touched[page_num] = 1;
+        stats.pages_touched++;
+    }
+}
+
+// map `page_num` to `frame`, -1 removes it
+void pager_map(uint32_t page_num, int32_t frame) {
+    if (page_num >= pager.frame_of_capacity) {
+        uint32_t capacity = page_num * 2 + 64;
+        pager.frame_of = realloc(pager.frame_of, capacity * sizeof(int32_t));
+        memset(pager.frame_of + pager.frame_of_capacity, 0xFF,
+               (capacity - pager.frame_of_capacity) * sizeof(int32_t));
+        pager.frame_of_capacity = capacity;
+    }
+    pager.frame_of[page_num] = frame;
+}
+
+/*
+ *a frame for a page that is not in the pool: a free one, otherwise the
+ *clock hand clears referenced bits until it finds a frame that has not been
+ *used since its last pass, which is written back if dirty
+ *a page stays in its frame for at least num_frames - 1 more misses
+ */
+uint32_t pager_take_frame() {
+    if (pager.free_frames >= 0) {
+        uint32_t frame = pager.free_frames;
+        pager.free_frames = pager.pages[frame].next_free;
+        return frame;
+    }
+    // while the flusher keeps the pool near its dirty target, dirty frames
+    // are passed over for one round and left to it
+    uint32_t dirty_skips =
+        pager.dirty * 100 <= pager.num_frames * flusher.dirty_target
+            ? pager.num_frames
+            : 0;
+    while (1) {
+        uint32_t frame = pager.clock_hand;
+        pager.clock_hand = (frame + 1) % pager.num_frames;
+        Page* page = &pager.pages[frame];
+        if (page->referenced) {
+            page->referenced = false;
+            continue;
+        }
+        if (page->written && dirty_skips > 0) {
+            dirty_skips--;
+            continue;
+        }
+        if (page->written) {
+            flusher.eviction_writes++;
+            pager_flush(frame);
+        }
+        pager_map(page->page_num, -1);
+        pager.evictions++;
+        return frame;
+    }
+}
+
+// page of a `:memory:` database, chunks are added as the table grows
+void* memory_page(uint32_t page_num) {
+    uint32_t chunk = page_num / MEMORY_CHUNK_PAGES;
+    if (chunk >= pager.memory_chunks_capacity) {
+        uint32_t capacity = chunk * 2 + 16;
+        pager.memory_chunks =
+            realloc(pager.memory_chunks, capacity * sizeof(char*));
+        memset(pager.memory_chunks + pager.memory_chunks_capacity, 0,
+               (capacity - pager.memory_chunks_capacity) * sizeof(char*));
+        pager.memory_chunks_capacity = capacity;
+    }
+    if (pager.memory_chunks[chunk] == NULL) {
+        pager.memory_chunks[chunk] =
+            calloc(MEMORY_CHUNK_PAGES, pager.page_size);
+    }
+    if (page_num >= pager.num_pages) {
+        pager.num_pages = page_num + 1;
+    }
+    return pager.memory_chunks[chunk] +
+           (size_t)(page_num % MEMORY_CHUNK_PAGES) * pager.page_size;
+}
+
+// get one page by page_num
+void* get_page(uint32_t page_num) {
+    if (stats.touched != NULL) {
+        stats_touch(page_num);
+    }
+    if (pager.in_memory) {
+        return memory_page(page_num);
+    }
+    if (page_num < pager.frame_of_capacity && pager.frame_of[page_num] >= 0) {
+        Page* page = &pager.pages[pager.frame_of[page_num]];
+        page->referenced = true;
+        pager.hits++;
+        return page->storage;
+    }
+
+    // if no cache, read from disk
+    pager.misses++;
+    uint32_t frame = pager_take_frame();
+    Page* page = &pager.pages[frame];
+    pager_read_page(page_num, page->storage);
+    page->page_num = page_num;
+    page->written = false;
+    page->referenced = true;
+    pager_map(page_num, frame);
+    if (page_num >= pager.num_pages) {
+        pager.num_pages = page_num + 1;
+    }
+    return page->storage;
+}
+
+// put every frame back on the free list, dirty pages are written first
+void pager_evict_all() {
+    if (pager.in_memory) {
+        return;
+    }
+    pager.free_frames = -1;
+    for (int32_t i = pager.num_frames - 1; i >= 0; i--) {
+        Page* page = &pager.pages[i];
+        if (page->page_num >= 0) {
+            if (page->written) {
+                pager_flush(i);
             }
-            return pager.pages[page_num].storage;
+            pager_map(page->page_num, -1);
+        }
+        page->page_num = -1;
+        page->written = false;
+        page->referenced = false;
+        page->next_free = pager.free_frames;
+        pager.free_frames = i;
+    }
+    pager.clock_hand = 0;
+    pager.dirty = 0;
+}
+
+// one slab for all frames, aligned to the system page so the frames can be
+// used for direct I/O, transparent huge pages are asked for when it is big
+void pager_alloc_frames() {
+    if (pager.num_frames == 0) {
+        pager.num_frames = DEFAULT_CACHE_PAGES;
+    }
+    size_t slab_size = (size_t)pager.num_frames * pager.page_size;
+    if (pager.slab != NULL && pager.slab_size != slab_size) {
+        munmap(pager.slab, pager.slab_size);
+        pager.slab = NULL;
+    }
+    if (pager.slab == NULL) {
+        pager.slab = mmap(NULL, slab_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pager.slab == MAP_FAILED) {
+            fprintf(stderr, "Unable to allocate %u pages of cache.\n",
+                    pager.num_frames);
+            exit(EXIT_FAILURE);
+        }
+#ifdef MADV_HUGEPAGE
+        if (slab_size >= (2 << 20)) {
+            madvise(pager.slab, slab_size, MADV_HUGEPAGE);
+        }
+#endif
+        pager.slab_size = slab_size;
+    }
+    pager.pages = realloc(pager.pages, pager.num_frames * sizeof(Page));
+    for (uint32_t i = 0; i < pager.num_frames; i++) {
+        pager.pages[i].page_num = -1;
+        pager.pages[i].storage = (char*)pager.slab + (size_t)i * pager.page_size;
+    }
+    free(pager.frame_of);
+    pager.frame_of = NULL;
+    pager.frame_of_capacity = 0;
+    pager_evict_all();
+}
+
+// a power of two the page layout supports
+bool page_size_valid(uint32_t page_size) {
+    return page_size >= MIN_PAGE_SIZE && page_size <= MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+// `:memory:`: no file and no buffer pool, an uncompressed snapshot is read
+// into whole chunks with one read and its pages are used in place
+void pager_open_memory(uint32_t page_size) {
+    pager.in_memory = true;
+    pager.file_descriptor = -1;
+    pager.file_length = 0;
+    pager.page_size = page_size;
+    pager.num_pages = 0;
+    pager.compression = 0;
+    if (pager.snapshot == NULL) {
+        return;
+    }
+
+    int fd = open(pager.snapshot, O_RDONLY);
+    if (fd == -1) {
+        fprintf(stderr, "Unable to open file '%s'.\n", pager.snapshot);
+        exit(EXIT_FAILURE);
+    }
+    off_t file_length = lseek(fd, 0, SEEK_END);
+    db_header header;
+    if (file_length <= 0 ||
+        pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        memcmp(header.magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0 ||
+        header.compression != 0 || header.partition_count > 1 ||
+        !page_size_valid(header.page_size) ||
+        file_length % header.page_size != 0 ||
+        header.root_page_num == DB_HEADER_PAGE_NUM ||
+        header.root_page_num >= file_length / header.page_size) {
+        fprintf(stderr, "File '%s' is not a myjql snapshot.\n", pager.snapshot);
+        exit(EXIT_FAILURE);
+    }
+    pager.page_size = header.page_size;
+    pager.num_pages = file_length / header.page_size;
+    pager.file_length = file_length;
+    pager.loaded_chunks =
+        (pager.num_pages + MEMORY_CHUNK_PAGES - 1) / MEMORY_CHUNK_PAGES;
+    pager.memory_chunks_capacity = pager.loaded_chunks + 16;
+    pager.memory_chunks = calloc(pager.memory_chunks_capacity, sizeof(char*));
+    size_t chunk_size = (size_t)MEMORY_CHUNK_PAGES * pager.page_size;
+    char* block = calloc(pager.loaded_chunks, chunk_size);
+    for (off_t done = 0; done < file_length;) {
+        ssize_t bytes_read = pread(fd, block + done, file_length - done, done);
+        if (bytes_read <= 0) {
+            fprintf(stderr, "Unable to read file '%s'.\n", pager.snapshot);
+            exit(EXIT_FAILURE);
+        }
+        done += bytes_read;
+    }
+    close(fd);
+    for (uint32_t i = 0; i < pager.loaded_chunks; i++) {
+        pager.memory_chunks[i] = block + i * chunk_size;
+    }
+}
+
+void pager_close_memory() {
+    for (uint32_t i = 0; i < pager.memory_chunks_capacity; i++) {
+        // the loaded chunks are one block
+        if (i == 0 || i >= pager.loaded_chunks) {
+            free(pager.memory_chunks[i]);
         }
     }
+    free(pager.memory_chunks);
+    pager.memory_chunks = NULL;
+    pager.memory_chunks_capacity = 0;
+    pager.loaded_chunks = 0;
+    pager.in_memory = false;
 }
-void pager_open(const char* filename) {
+
+// open database file, `page_size` is only used when the file is new,
+// otherwise the page size recorded in the file header wins
+// `compression` selects the compressed layout for a new file (0: off) and
+// overrides the level of a compressed file, negative keeps its level
+void pager_open(const char* filename, uint32_t page_size, int compression) {
+    if (strcmp(filename, MEMORY_DATABASE) == 0) {
+        pager_open_memory(page_size);
+        return;
+    }
     int fd = open(filename, O_RDWR | O_CREAT, S_IWUSR | S_IRUSR);
     if (fd == -1) {
-        // FIXME: handle open failure
+        fprintf(stderr, "Unable to open file '%s'.\n", filename);
+        exit(EXIT_FAILURE);
     }
     off_t file_length = lseek(fd, 0, SEEK_END);
 
+    db_header header;
+    memset(&header, 0, sizeof(header));
+    if (file_length > 0) {
+        ssize_t bytes_read = pread(fd, &header, sizeof(header), 0);
+        if (bytes_read != sizeof(header) ||
+            memcmp(header.magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0) {
+            fprintf(stderr, "File '%s' is not a myjql database.\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        page_size = header.page_size;
+        if (!page_size_valid(page_size) || file_length < page_size) {
+            fprintf(stderr, "File '%s' is corrupt.\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        if (header.compression && compression > 0) {
+            header.compression = compression;
+        }
+    } else if (compression > 0) {
+        header.compression = compression;
+    }
+
     pager.file_descriptor = fd;
     pager.file_length = file_length;
-    pager.num_pages = (file_length / PAGE_SIZE);
+    pager.page_size = page_size;
+    pager.num_pages = (file_length / page_size);
+    pager.compression = header.compression;
+
+    if (pager.compression) {
+        // the table lies between the header page and the end of the file
+        uint64_t plt_size =
+            (uint64_t)header.plt_num_pages * sizeof(page_location);
+        if (file_length > 0 &&
+            ((header.plt_num_pages > 0 && header.plt_offset < page_size) ||
+             header.plt_offset > (uint64_t)file_length ||
+             plt_size > (uint64_t)file_length - header.plt_offset)) {
+            fprintf(stderr, "File '%s' is corrupt.\n", filename);
+            exit(EXIT_FAILURE);
+        }
+        pager.num_pages = header.plt_num_pages;
+        pager.locations_capacity = header.plt_num_pages;
+        pager.locations = calloc(pager.locations_capacity + 1,
+                                 sizeof(page_location));
+        if (pager.locations_capacity > 0) {
+            ssize_t bytes_read =
+                pread(fd, pager.locations,
+                      pager.locations_capacity * sizeof(page_location),
+                      header.plt_offset);
+            if (bytes_read !=
+                pager.locations_capacity * sizeof(page_location)) {
+                fprintf(stderr, "File '%s' is corrupt.\n", filename);
+                exit(EXIT_FAILURE);
+            }
+        }
+        for (uint32_t i = 0; i < pager.locations_capacity; i++) {
+            page_location* location = &pager.locations[i];
+            // the reserved space may run past the end, what was written not
+            if (location->length > page_size ||
+                location->length > location->capacity ||
+                location->offset > (uint64_t)file_length ||
+                location->length > file_length - location->offset) {
+                fprintf(stderr, "File '%s' is corrupt.\n", filename);
+                exit(EXIT_FAILURE);
+            }
+        }
+        // the table stays where it is until a new copy has replaced it
+        pager.plt_offset = header.plt_offset;
+        pager.plt_num_pages = header.plt_num_pages;
+        pager.plt_spare_offset = 0;
+        pager.plt_spare_size = 0;
+        pager.data_end = file_length > page_size ? (uint64_t)file_length
+                                                 : (uint64_t)page_size;
+        // every slot of the file is in the table on disk
+        pager.durable = malloc(pager.locations_capacity + 1);
+        memset(pager.durable, 1, pager.locations_capacity + 1);
+        pager.free_slots = calloc(page_size / PAGE_LOCATION_GRANULE + 2,
+                                  sizeof(slot_list));
+        if (file_length > 0) {
+            pager_find_free_slots();
+        }
+        pager.compress_buffer = malloc(lz_compress_bound(page_size));
+        pager.compress_workspace = malloc(LZ_WORKSPACE_SIZE);
+    } else if (file_length % page_size != 0) {
+        fprintf(stderr, "File '%s' is corrupt.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+    // an existing file has its header page and the root
+    if (file_length > 0 && (header.root_page_num == DB_HEADER_PAGE_NUM ||
+                            header.root_page_num >= pager.num_pages)) {
+        fprintf(stderr, "File '%s' is corrupt.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    // the header was read through the page cache, from here on every read
+    // and write is a whole page at a page-aligned offset into a frame of
+    // the slab, which is aligned to the system page
+    if (pager.direct_io) {
+        if (pager.compression) {
+            fprintf(stderr, "Direct I/O needs an uncompressed database.\n");
+            exit(EXIT_FAILURE);
+        }
+        if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == -1) {
+            fprintf(stderr, "Direct I/O is not supported for '%s'.\n",
+                    filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pager_alloc_frames();
+}
+
+/*
+ *per-leaf summaries of column b, kept beside the pager: a 256 bit bloom
+ *filter, the smallest and largest value and a copy of next_leaf, so scans
+ *filtered on b pass over leaves that cannot match without get_page
+ *a summary is built when a scan reads its leaf, the leaf operations keep it
+ *up to date or conservative, any other change invalidates it
+ *summaries live in memory only, the first scan after open builds them
+ */
+#define SUMMARY_BLOOM_WORDS 4
+typedef struct {
+    bool valid;
+    uint32_t next_leaf;
+    uint64_t bloom[SUMMARY_BLOOM_WORDS];
+    char min_b[COLUMN_B_SIZE + 1];
+    char max_b[COLUMN_B_SIZE + 1];
+} leaf_summary;
+typedef struct {
+    leaf_summary* leaves;  // by page_num
+    uint32_t capacity;
+} leaf_summaries;
+leaf_summaries summaries;
+
+uint64_t hash_b(const char* b) {
+    uint64_t low;
+    uint32_t high;
+    memcpy(&low, b, sizeof(low));
+    memcpy(&high, b + sizeof(low), sizeof(high));
+    uint64_t h = low * 0x9E3779B97F4A7C15ULL ^ high * 0xC2B2AE3D27D4EB4FULL;
+    return h ^ (h >> 29);
+}
+
+leaf_summary* summary_get(uint32_t page_num) {
+    if (page_num >= summaries.capacity) {
+        uint32_t capacity = page_num * 2 + 64;
+        summaries.leaves =
+            realloc(summaries.leaves, capacity * sizeof(leaf_summary));
+        memset(summaries.leaves + summaries.capacity, 0,
+               (capacity - summaries.capacity) * sizeof(leaf_summary));
+        summaries.capacity = capacity;
+    }
+    return &summaries.leaves[page_num];
+}
+
+void summary_reset() {
+    free(summaries.leaves);
+    summaries.leaves = NULL;
+    summaries.capacity = 0;
+}
+
+void summary_invalidate(uint32_t page_num) {
+    if (page_num < summaries.capacity) {
+        summaries.leaves[page_num].valid = false;
+    }
+}
 
-    if (file_length % PAGE_SIZE != 0) {
-        // FIXME: handle corrupt file
+// two bits of the bloom filter per value
+void summary_add(leaf_summary* summary, const char* b) {
+    uint64_t h = hash_b(b);
+    summary->bloom[(h >> 6) & 3] |= 1ULL << (h & 63);
+    summary->bloom[(h >> 14) & 3] |= 1ULL << ((h >> 8) & 63);
+    if (memcmp(b, summary->min_b, B_SIZE) < 0) {
+        memcpy(summary->min_b, b, B_SIZE);
     }
+    if (memcmp(b, summary->max_b, B_SIZE) > 0) {
+        memcpy(summary->max_b, b, B_SIZE);
+    }
+}
+
+void summary_build(uint32_t page_num, leaf_node* node) {
+    leaf_summary* summary = summary_get(page_num);
+    memset(summary, 0, sizeof(leaf_summary));
+    memset(summary->min_b, 0xFF, B_SIZE);
+    for (uint32_t i = 0; i < node->num_cells; i++) {
+        summary_add(summary, node->values[i].b);
+    }
+    summary->next_leaf = node->next_leaf;
+    summary->valid = true;
+}
+
+// `b` was written to a cell of the leaf
+void summary_update(uint32_t page_num, const char* b) {
+    if (page_num < summaries.capacity && summaries.leaves[page_num].valid) {
+        summary_add(&summaries.leaves[page_num], b);
+    }
+}
 
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        // initialize all pages to null
-        pager.pages[i].storage = NULL;
+bool summary_excludes(uint32_t page_num, const char* b) {
+    if (page_num >= summaries.capacity || !summaries.leaves[page_num].valid) {
+        return false;
+    }
+    leaf_summary* summary = &summaries.leaves[page_num];
+    uint64_t h = hash_b(b);
+    if (!(summary->bloom[(h >> 6) & 3] & (1ULL << (h & 63))) ||
+        !(summary->bloom[(h >> 14) & 3] & (1ULL << ((h >> 8) & 63)))) {
+        return true;
+    }
+    return memcmp(b, summary->min_b, B_SIZE) < 0 ||
+           memcmp(b, summary->max_b, B_SIZE) > 0;
+}
+
+// first leaf from `page_num` on that may hold `b`, 0 at the end of the chain
+uint32_t leaf_chain_seek(uint32_t page_num, const char* b) {
+    while (page_num != 0 && summary_excludes(page_num, b)) {
+        stats.leaves_skipped++;
+        page_num = summaries.leaves[page_num].next_leaf;
+    }
+    return page_num;
+}
+
+// read a leaf for a scan filtered on b, summarizing it on the way
+leaf_node* get_leaf_summarized(uint32_t page_num) {
+    leaf_node* node = get_page(page_num);
+    if (page_num >= summaries.capacity || !summaries.leaves[page_num].valid) {
+        summary_build(page_num, node);
     }
+    return node;
 }
 
 NodeType get_node_type(void* node) {
@@ -256,12 +1153,13 @@ NodeType get_node_type(void* node) {
 // copy data to database
 void serialize_row(Row* source, leaf_node_body* destination) {
     destination->a = source->a;
-    strcpy(destination->b, source->b);
+    // whole column, the padding is compared by b_tree_search
+    memcpy(destination->b, source->b, B_SIZE);
 }
 // copy data from database to destination
 void deserialize_row(leaf_node_body* source, Row* destination) {
     destination->a = source->a;
-    strcpy(destination->b, source->b);
+    memcpy(destination->b, source->b, B_SIZE);
     /*memcpy(&(destination->a), source + A_OFFSET, A_SIZE);*/
     /*memcpy(&(destination->b), source + B_OFFSET, B_SIZE);*/
 }
@@ -284,16 +1182,22 @@ bool is_node_root(void* node) {
     return (bool)value;
 }
 // get max key number for a node
+// the max key of an internal node lives in its rightest subtree
 uint32_t get_node_max_key(void* node) {
     NodeType type = get_node_type(node);
     if (type == NODE_INTERNAL) {
         internal_node* new_node = node;
-        return new_node->body[new_node->num_keys - 1].key;
+        return get_node_max_key(get_page(new_node->rightest_child));
     } else if (type == NODE_LEAF) {
         leaf_node* new_node = node;
+        if (new_node->num_cells == 0) {
+            return 0;
+        }
         return new_node->values[new_node->num_cells - 1].a;
     }
-    // FIXME: node type
+    // only a damaged page has another type
+    fprintf(stderr, "Node type %u is corrupt.\n", type);
+    exit(EXIT_FAILURE);
 }
 // return parent pointer of a node
 uint32_t* node_parent(void* node) { return node + PARENT_POINTER_OFFSET; }
@@ -323,171 +1227,143 @@ uint32_t* internal_node_num_keys(void* node) {
 uint32_t* internal_node_child(void* node, uint32_t child_num) {
     uint32_t num_keys = *internal_node_num_keys(node);
     if (child_num > num_keys) {
-        // FIXME: handle more child than keys
+        fprintf(stderr, "Child %u of a node with %u keys.\n", child_num,
+                num_keys);
+        exit(EXIT_FAILURE);
     } else if (child_num == num_keys) {
         return internal_node_right_child(node);
     } else {
         return internal_node_cell(node, child_num);
     }
 }
-void internal_node_split(uint32_t page_num) {
+// point every child of an internal node back to it
+void internal_node_adopt_children(uint32_t page_num) {
     internal_node* node = get_page(page_num);
-    if (node->is_root) {
-        // if internal node is root
-        // initialize two nodes
-        uint32_t new_root_page_num = get_unused_page_num();
-        internal_node* new_root_node = get_page(new_root_page_num);
-        initialize_internal_node(new_root_node);
-        uint32_t new_right_page_num = get_unused_page_num();
-        internal_node* new_right_node = get_page(new_right_page_num);
-        initialize_internal_node(new_right_node);
-        // set nodes meta data
-        node->is_root = false;
-        new_root_node->is_root = true;
-        new_root_node->rightest_child = new_right_page_num;
-        node->parent = new_root_page_num;
-        new_right_node->parent = new_root_page_num;
-
-        // 251 -- 499
-        for (uint32_t i = INTERNAL_NODE_MAX_CELLS - 1;
-             i > INTERNAL_NODE_LEFT_SPLIT_SIZE; i--) {
-            new_right_node->body[i % INTERNAL_NODE_LEFT_SPLIT_SIZE + 1] =
-                node->body[i];
-        }
-        new_root_node->body[0].key =
-            node->body[INTERNAL_NODE_LEFT_SPLIT_SIZE].key;
-        new_root_node->num_keys = 1;
-        new_root_node->body[0].child = page_num;
-        new_right_node->rightest_child = node->rightest_child;
-
-        new_right_node->rightest_child = node->rightest_child;
-        node->rightest_child = node->body[INTERNAL_NODE_LEFT_SPLIT_SIZE].key;
-        new_right_node->num_keys = INTERNAL_NODE_RIGHT_SPLIT_SIZE;
-        node->num_keys = INTERNAL_NODE_LEFT_SPLIT_SIZE;
-
-        mark_written(new_root_page_num);
-        mark_written(new_right_page_num);
-    } else {
-        uint32_t old_max_key = get_node_max_key(node);
-        internal_node* parent = get_page(node->parent);
-        uint32_t new_right_page_num = get_unused_page_num();
-        internal_node* new_right_node = get_page(new_right_page_num);
-        initialize_internal_node(new_right_node);
-        new_right_node->parent = node->parent;
-        // 250 -- 499
-        for (uint32_t i = INTERNAL_NODE_MAX_CELLS - 1;
-             i > INTERNAL_NODE_LEFT_SPLIT_SIZE; i--) {
-            new_right_node->body[i % INTERNAL_NODE_LEFT_SPLIT_SIZE + 1] =
-                node->body[i];
-        }
-        node->num_keys = INTERNAL_NODE_LEFT_SPLIT_SIZE;
-        new_right_node->num_keys = INTERNAL_NODE_RIGHT_SPLIT_SIZE + 1;
-        new_right_node->rightest_child = node->rightest_child;
-        update_internal_node_key(parent, old_max_key, get_node_max_key(node));
-        internal_node_insert(node->parent, new_right_page_num);
-
-        mark_written(new_right_page_num);
-        mark_written(node->parent);
+    uint32_t num_keys = node->num_keys;
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        uint32_t child_page_num = *internal_node_child(node, i);
+        void* child = get_page(child_page_num);
+        *node_parent(child) = page_num;
+        mark_written(child_page_num);
+        // re-fetch, visiting many children may have recycled the frame
+        node = get_page(page_num);
     }
 }
 /*
- *add new child to internal node
- *child can be leaf or internal node
+ *root page never moves: its content is copied to a new left child and the
+ *root becomes an internal node over the left and the right child
+ *`left_max_key` bounds the keys of the left child
  */
-void internal_node_insert(uint32_t parent_page_num, uint32_t child_page_num) {
-    internal_node* parent = get_page(parent_page_num);
-    void* child = get_page(child_page_num);
-    uint32_t child_max_key = get_node_max_key(child);
-    uint32_t index = internal_node_find_child(parent, child_max_key);
+void create_new_root(uint32_t right_child_page_num, uint32_t left_max_key) {
+    uint32_t root_page_num = table.root_page_num;
+    uint32_t left_child_page_num = get_unused_page_num();
+    void* left_child = get_page(left_child_page_num);
+    void* root = get_page(root_page_num);
+    memcpy(left_child, root, pager.page_size);
+    summary_invalidate(root_page_num);
+    set_node_root(left_child, false);
+    *node_parent(left_child) = root_page_num;
+    mark_written(left_child_page_num);
+    if (get_node_type(left_child) == NODE_INTERNAL) {
+        internal_node_adopt_children(left_child_page_num);
+    }
+    internal_node* new_root = get_page(root_page_num);
+    initialize_internal_node(new_root);
+    new_root->is_root = true;
+    new_root->num_keys = 1;
+    new_root->body[0].child = left_child_page_num;
+    new_root->body[0].key = left_max_key;
+    new_root->rightest_child = right_child_page_num;
+    mark_written(root_page_num);
+    stats.root_splits++;
 
-    uint32_t original_num_keys = parent->num_keys;
-    parent->num_keys += 1;
-    mark_written(parent_page_num);
+    *node_parent(get_page(right_child_page_num)) = root_page_num;
+    mark_written(right_child_page_num);
+}
+// distance from a node down to the leaves
+uint32_t node_level(uint32_t page_num) {
+    uint32_t level = 0;
+    void* node = get_page(page_num);
+    while (get_node_type(node) == NODE_INTERNAL &&
+           level < STATS_MAX_HEIGHT - 1) {
+        node = get_page(((internal_node*)node)->rightest_child);
+        level++;
+    }
+    return level;
+}
+// node holds internal_node_max_cells keys: keep the left half, move the
+// right half to a new node and hand the middle key to the parent
+// `level` is the node's distance to the leaves, known from the descent
+void internal_node_split(uint32_t page_num, uint32_t level) {
+    stats.splits[level < STATS_MAX_HEIGHT ? level : STATS_MAX_HEIGHT - 1]++;
+    internal_node* node = get_page(page_num);
+    uint32_t left_size = table.internal_node_left_split_size;
+    uint32_t right_size = table.internal_node_right_split_size;
 
-    uint32_t right_child_page_num = parent->rightest_child;
-    void* right_child = get_page(right_child_page_num);
+    uint32_t new_right_page_num = get_unused_page_num();
+    internal_node* new_right_node = get_page(new_right_page_num);
+    node = get_page(page_num);
+    initialize_internal_node(new_right_node);
+    new_right_node->parent = node->parent;
 
-    if (child_max_key > get_node_max_key(right_child)) {
-        parent->body[original_num_keys].child = right_child_page_num;
-        parent->body[original_num_keys].key = get_node_max_key(right_child);
-        parent->rightest_child = child_page_num;
-    } else {
-        for (int i = original_num_keys; i > index; i--) {
-            parent->body[i] = parent->body[i - 1];
-        }
-        parent->body[index].child = child_page_num;
-        parent->body[index].key = child_max_key;
+    // left_size + 1 -- max cells - 1
+    for (uint32_t i = 0; i < right_size; i++) {
+        new_right_node->body[i] = node->body[left_size + 1 + i];
+    }
+    new_right_node->num_keys = right_size;
+    new_right_node->rightest_child = node->rightest_child;
+
+    // the child at left_size becomes rightest, its key bounds the left node
+    uint32_t new_max_key = node->body[left_size].key;
+    node->rightest_child = node->body[left_size].child;
+    node->num_keys = left_size;
+    mark_written(page_num);
+    mark_written(new_right_page_num);
+
+    internal_node_adopt_children(new_right_page_num);
+
+    node = get_page(page_num);
+    if (node->is_root) {
+        create_new_root(new_right_page_num, new_max_key);
+    } else {
+        internal_node_insert(node->parent, page_num, new_right_page_num,
+                             new_max_key, level + 1);
     }
-    if (parent->num_keys >= INTERNAL_NODE_MAX_CELLS) {
-        internal_node_split(parent_page_num);
+}
+/*
+ *add new child to internal node, right after `left_page_num` which was just
+ *split and now holds keys up to `left_max_key`
+ *child can be leaf or internal node, it takes over the key its left sibling
+ *had, so keys stay upper bounds and are never read from the children:
+ *deletion may leave a child with smaller keys or none at all
+ *`level` is the parent's distance to the leaves, 1 above a leaf
+ */
+void internal_node_insert(uint32_t parent_page_num, uint32_t left_page_num,
+                          uint32_t child_page_num, uint32_t left_max_key,
+                          uint32_t level) {
+    internal_node* parent = get_page(parent_page_num);
+    uint32_t num_keys = parent->num_keys;
+
+    if (parent->rightest_child == left_page_num) {
+        parent->body[num_keys].child = left_page_num;
+        parent->body[num_keys].key = left_max_key;
+        parent->rightest_child = child_page_num;
+    } else {
+        uint32_t index = internal_node_find_child(parent, left_max_key);
+        for (uint32_t i = num_keys; i > index + 1; i--) {
+            parent->body[i] = parent->body[i - 1];
+        }
+        parent->body[index + 1].child = child_page_num;
+        parent->body[index + 1].key = parent->body[index].key;
+        parent->body[index].key = left_max_key;
     }
+    parent->num_keys += 1;
+    mark_written(parent_page_num);
 
     // first insert node then split
-    /*
-     *    if (original_num_keys >= INTERNAL_NODE_MAX_CELLS) {
-     *        if (is_node_root(parent)) {
-     *            // parent internal node is root and needs spliting
-     *            uint32_t new_page_num1 = get_unused_page_num(table.pager);
-     *            void* new_node1 = get_page(table.pager, new_page_num1);
-     *            initialize_internal_node(new_node1);
-     *            uint32_t new_page_num2 = get_unused_page_num(table.pager);
-     *            void* new_node2 = get_page(table.pager, new_page_num2);
-     *            initialize_internal_node(new_node2);
-     *            set_node_root(parent, false);
-     *            set_node_root(new_node1, true);
-     *            *node_parent(parent) = new_page_num1;
-     *            *node_parent(new_node2) = new_page_num1;
-     *
-     *            for (int32_t i = INTERNAL_NODE_MAX_CELLS; i >= 0; i--) {
-     *                if (i == INTERNAL_NODE_LEFT_SPLIT_SIZE) {
-     *                    // put to root
-     *                    *internal_node_key(new_node1, 0) =
-     *                        *internal_node_key(parent, i);
-     *                    // root child points to left and right
-     *                    *internal_node_child(new_node1, 0) = parent_page_num;
-     *                    *internal_node_right_child(new_node1) = new_page_num2;
-     *                } else if (i > INTERNAL_NODE_LEFT_SPLIT_SIZE) {
-     *                    // put to right
-     *                    uint32_t right_index =
-     *                        i % (INTERNAL_NODE_LEFT_SPLIT_SIZE + 1);
-     *                    memcpy(new_node2, internal_node_cell(parent, i),
-     *                           INTERNAL_NODE_CELL_SIZE);
-     *                    *internal_node_right_child(new_node2) =
-     *                        *internal_node_right_child(parent);
-     *                }
-     *            }
-     *            *internal_node_right_child(parent) =
-     *                *internal_node_child(parent,
-     * INTERNAL_NODE_LEFT_SPLIT_SIZE);
-     *            // renumber node key nums
-     *            *internal_node_num_keys(parent) =
-     * INTERNAL_NODE_LEFT_SPLIT_SIZE; *internal_node_num_keys(new_node1) = 1;
-     *            *internal_node_num_keys(new_node2) =
-     * INTERNAL_NODE_RIGHT_SPLIT_SIZE; } else {
-     *            // new internal node on the right
-     *            uint32_t new_page_num = get_unused_page_num(table.pager);
-     *            void* new_node = get_page(table.pager, new_page_num);
-     *            initialize_internal_node(new_node);
-     *            for (int32_t i = INTERNAL_NODE_MAX_CELLS; i >= 0; i--) {
-     *                if (i >= INTERNAL_NODE_LEFT_SPLIT_SIZE) {
-     *                    uint32_t right_index =
-     *                        i % (INTERNAL_NODE_LEFT_SPLIT_SIZE + 1);
-     *                    memcpy(new_node, internal_node_cell(parent, i),
-     *                           INTERNAL_NODE_CELL_SIZE);
-     *                    *internal_node_right_child(new_node) =
-     *                        *internal_node_right_child(parent);
-     *                }
-     *            }
-     *            *internal_node_right_child(parent) =
-     *                *internal_node_child(parent,
-     * INTERNAL_NODE_LEFT_SPLIT_SIZE); *internal_node_num_keys(parent) =
-     * INTERNAL_NODE_LEFT_SPLIT_SIZE; *internal_node_num_keys(new_node) =
-     *                INTERNAL_NODE_RIGHT_SPLIT_SIZE + 1;
-     *
-     *            internal_node_insert(*node_parent(parent), new_page_num);
-     *        }
-     *    }
-     */
+    if (parent->num_keys >= table.internal_node_max_cells) {
+        internal_node_split(parent_page_num, level);
+    }
 }
 /*
  * leaf node utility functions
@@ -528,39 +1404,186 @@ void initialize_internal_node(internal_node* node) {
     node->num_keys = 0;
 }
 
-void open_file(const char* filename) { /* open file */
+void open_file(const char* filename, uint32_t page_size,
+               int compression) { /* open file */
 
     // table and pager is already defined globally
-    pager_open(filename);
-    table.pager = pager;
-    table.root_page_num = 0;
+    pager_open(filename, page_size, compression);
+    table_set_page_size(pager.page_size);
+    summary_reset();
 
-    // new table
-    internal_node* root_node = get_page(0);
-    initialize_internal_node(root_node);
+    if (pager.file_length > 0) {
+        db_header* header = get_page(DB_HEADER_PAGE_NUM);
+        table.root_page_num = header->root_page_num;
+        table.pager = pager;
+        return;
+    }
 
+    // new table: page 0 holds the header, root starts as an empty leaf
+    db_header* header = get_page(DB_HEADER_PAGE_NUM);
+    memset(header, 0, pager.page_size);
+    memcpy(header->magic, DB_MAGIC, sizeof(DB_MAGIC));
+    header->page_size = pager.page_size;
+    header->root_page_num = get_unused_page_num();
+    header->compression = pager.compression;
+    mark_written(DB_HEADER_PAGE_NUM);
+    table.root_page_num = header->root_page_num;
+
+    leaf_node* root_node = get_page(table.root_page_num);
+    initialize_leaf_node(root_node);
     root_node->is_root = true;
+    mark_written(table.root_page_num);
+    table.pager = pager;
+}
 
-    // pre build tree
-    for (int i = 0; i <= 20; i++) {
-        uint32_t page_num = get_unused_page_num();
-        void* page = malloc(PAGE_SIZE);
-        pager.pages[page_num].storage = page;
-        pager.num_pages = page_num + 1;
+/*
+ *partitioned tables: rows are assigned to one of up to MAX_PARTITIONS files
+ *by a hash or a range of a, each file is a complete database with its own
+ *pager, buffer pool, B+tree and summaries
+ *the engine works on the globals `pager`, `table` and `summaries`, so the
+ *partition an operation works on is swapped into them: inserts use the
+ *partition of their key, everything else visits every partition in turn
+ *partition 0 is FILE, partition i is FILE.i
+ */
+struct Partition {
+    Pager pager;
+    Table table;
+    leaf_summaries summaries;
+};
 
-        leaf_node* node = get_page(page_num);
-        initialize_leaf_node(node);
-        node->node_type = NODE_LEAF;
-        node->next_leaf = page_num + 1;
-        node->num_cells = 0;
+// page I/O counters are for the whole table, they follow the active pager
+void pager_move_counters(Pager* to, const Pager* from) {
+    to->pages_read = from->pages_read;
+    to->pages_written = from->pages_written;
+    to->hits = from->hits;
+    to->misses = from->misses;
+    to->evictions = from->evictions;
+}
 
-        root_node->body[i].child = page_num;
-        root_node->body[i].key = (250 * (i + 1)) - 1;
+void partition_use(uint32_t index) {
+    if (index == partitions.current) {
+        return;
     }
-    leaf_node* node = get_page(20);
-    node->next_leaf = 0;
+    Partition* from = &partitions.parts[partitions.current];
+    Partition* to = &partitions.parts[index];
+    from->pager = pager;
+    from->table = table;
+    from->summaries = summaries;
+    pager_move_counters(&to->pager, &pager);
+    pager = to->pager;
+    table = to->table;
+    summaries = to->summaries;
+    partitions.current = index;
+}
 
-    root_node->num_keys = 20;
+uint32_t partition_of(uint32_t key) {
+    if (partitions.count == 1) {
+        return 0;
+    }
+    if (partitions.scheme == MYJQL_PARTITION_RANGE) {
+        // keys are at most INT32_MAX, equal ranges of it
+        return key / ((uint32_t)INT32_MAX / partitions.count + 1);
+    }
+    return ((uint64_t)(key * 2654435761u) * partitions.count) >> 32;
+}
+
+/*
+ *open FILE and, if it is partition 0 of a partitioned table, the others
+ *`count` and `scheme` only apply when FILE is created, the frames of the
+ *buffer pool are divided between the partitions
+ */
+void partitions_open(const char* filename, uint32_t page_size,
+                     int compression, uint32_t count,
+                     myjql_partitioning scheme) {
+    uint32_t frames = pager.num_frames;
+    open_file(filename, page_size, compression);
+    db_header* header = get_page(DB_HEADER_PAGE_NUM);
+    bool created = pager.file_length == 0;
+    if (created && count > 1) {
+        header->partition_count = count;
+        header->partition_scheme = scheme;
+        mark_written(DB_HEADER_PAGE_NUM);
+    }
+    partitions.count = header->partition_count ? header->partition_count : 1;
+    partitions.scheme = header->partition_scheme;
+    partitions.current = 0;
+    if (partitions.count == 1) {
+        return;
+    }
+    if (pager.in_memory) {
+        fprintf(stderr, "A :memory: database has a single partition.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (partitions.count > MAX_PARTITIONS || header->partition_index != 0) {
+        fprintf(stderr, "File '%s' is not partition 0 of a table.\n", filename);
+        exit(EXIT_FAILURE);
+    }
+
+    frames /= partitions.count;
+    if (frames < MIN_CACHE_PAGES) {
+        frames = MIN_CACHE_PAGES;
+    }
+    pager_evict_all();
+    pager.num_frames = frames;
+    pager_alloc_frames();
+    partitions.parts = calloc(partitions.count, sizeof(Partition));
+
+    size_t name_size = strlen(filename) + 16;
+    char* name = malloc(name_size);
+    for (uint32_t i = 1; i < partitions.count; i++) {
+        Partition* previous = &partitions.parts[i - 1];
+        previous->pager = pager;
+        previous->table = table;
+        previous->summaries = summaries;
+        memset(&pager, 0, sizeof(pager));
+        memset(&summaries, 0, sizeof(summaries));
+        pager_move_counters(&pager, &previous->pager);
+        pager.num_frames = frames;
+        pager.direct_io = previous->pager.direct_io;
+        partitions.current = i;
+
+        snprintf(name, name_size, "%s.%u", filename, i);
+        open_file(name, previous->pager.page_size, compression);
+        header = get_page(DB_HEADER_PAGE_NUM);
+        if (created && pager.file_length != 0) {
+            fprintf(stderr, "File '%s' already exists.\n", name);
+            exit(EXIT_FAILURE);
+        } else if (pager.file_length == 0) {
+            header->partition_count = partitions.count;
+            header->partition_index = i;
+            header->partition_scheme = partitions.scheme;
+            mark_written(DB_HEADER_PAGE_NUM);
+        } else if (header->partition_count != partitions.count ||
+                   header->partition_index != i ||
+                   header->page_size != previous->pager.page_size) {
+            fprintf(stderr, "File '%s' is not partition %u of '%s'.\n", name,
+                    i, filename);
+            exit(EXIT_FAILURE);
+        }
+    }
+    free(name);
+    partition_use(0);
+}
+
+// flush and close every partition, partition 0 stays in the globals
+void partitions_close() {
+    for (uint32_t i = partitions.count; i-- > 0;) {
+        partition_use(i);
+        db_close();
+    }
+    for (uint32_t i = 1; i < partitions.count; i++) {
+        Partition* part = &partitions.parts[i];
+        munmap(part->pager.slab, part->pager.slab_size);
+        free(part->pager.pages);
+        free(part->pager.frame_of);
+        free(part->pager.locations);
+        free(part->pager.compress_buffer);
+        free(part->pager.compress_workspace);
+        free(part->summaries.leaves);
+    }
+    free(partitions.parts);
+    partitions.parts = NULL;
+    partitions.count = 1;
 }
 
 void exit_nicely(int code) {
@@ -568,14 +1591,622 @@ void exit_nicely(int code) {
     exit(code);
 }
 
-void exit_success() {
-    printf("bye~\n");
-    exit_nicely(EXIT_SUCCESS);
+// statement latencies are kept in log-linear buckets: 8 per power of two
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+
+// statements/s of the whole session, enabled by --throughput
+struct {
+    bool enabled;
+    uint64_t statements;
+    struct timespec start;
+    // per StatementType
+    uint64_t count[3];
+    double seconds[3];
+    uint64_t latency[3][LATENCY_BUCKETS];  // nanoseconds
+    uint64_t errors;
+    double parse_seconds;  // batch mode, spent ahead of execution
+    const char* report_path;  // --report, JSON
+} throughput;
+
+double elapsed_seconds(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+uint32_t latency_bucket(uint64_t nanoseconds) {
+    if (nanoseconds < LATENCY_SUB_BUCKETS) {
+        return nanoseconds;
+    }
+    uint32_t exponent = 63 - __builtin_clzll(nanoseconds);
+    uint32_t sub_bucket = (nanoseconds >> (exponent - 3)) & 7;
+    return (exponent - 2) * LATENCY_SUB_BUCKETS + sub_bucket;
+}
+
+// middle of the bucket holding the q-th quantile, in microseconds
+double latency_quantile(uint64_t* buckets, uint64_t count, double q) {
+    uint64_t rank = q * count;
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank) {
+            if (i < LATENCY_SUB_BUCKETS) {
+                return i / 1e3;
+            }
+            uint32_t exponent = i / LATENCY_SUB_BUCKETS + 2;
+            uint64_t low = (uint64_t)(LATENCY_SUB_BUCKETS +
+                                      i % LATENCY_SUB_BUCKETS)
+                           << (exponent - 3);
+            uint64_t width = 1ull << (exponent - 3);
+            return (low + width / 2) / 1e3;
+        }
+    }
+    return 0;
+}
+
+// machine readable version of report_throughput, for the benchmarks
+void write_report() {
+    static const char* names[] = {"insert", "select", "delete"};
+    FILE* file = fopen(throughput.report_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to write report '%s'.\n",
+                throughput.report_path);
+        return;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double seconds = elapsed_seconds(&throughput.start);
+    fprintf(file,
+            "{\"statements\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+            "\"parse_seconds\":%.6f,\"errors\":%llu,\"pages_read\":%llu,"
+            "\"pages_written\":%llu,\"peak_rss_kb\":%ld",
+            (unsigned long long)throughput.statements, seconds,
+            seconds > 0 ? throughput.statements / seconds : 0.0,
+            throughput.parse_seconds, (unsigned long long)throughput.errors,
+            (unsigned long long)pager.pages_read,
+            (unsigned long long)pager.pages_written, usage.ru_maxrss);
+    for (int i = 0; i < 3; i++) {
+        uint64_t count = throughput.count[i];
+        fprintf(file,
+                ",\"%s\":{\"count\":%llu,\"seconds\":%.6f,"
+                "\"ops_per_sec\":%.1f,\"p50_us\":%.3f,\"p99_us\":%.3f}",
+                names[i], (unsigned long long)count, throughput.seconds[i],
+                throughput.seconds[i] > 0 ? count / throughput.seconds[i] : 0.0,
+                latency_quantile(throughput.latency[i], count, 0.50),
+                latency_quantile(throughput.latency[i], count, 0.99));
+    }
+    fprintf(file, "}\n");
+    fclose(file);
+}
+
+void report_throughput() {
+    if (!throughput.enabled) {
+        return;
+    }
+    if (throughput.report_path != NULL) {
+        write_report();
+    }
+    static const char* names[] = {"insert", "select", "delete"};
+    double seconds = elapsed_seconds(&throughput.start);
+    fprintf(stderr, "%llu statements in %.3f s (%.0f statements/s)\n",
+            (unsigned long long)throughput.statements, seconds,
+            seconds > 0 ? throughput.statements / seconds : 0.0);
+    for (int i = 0; i < 3; i++) {
+        if (throughput.count[i] == 0) {
+            continue;
+        }
+        fprintf(stderr, "  %s: %llu in %.3f s (%.0f statements/s)\n", names[i],
+                (unsigned long long)throughput.count[i], throughput.seconds[i],
+                throughput.seconds[i] > 0
+                    ? throughput.count[i] / throughput.seconds[i]
+                    : 0.0);
+    }
+    if (throughput.parse_seconds > 0) {
+        fprintf(stderr, "  parse: %.3f s\n", throughput.parse_seconds);
+    }
+    if (throughput.errors > 0) {
+        fprintf(stderr, "  errors: %llu\n", (unsigned long long)throughput.errors);
+    }
+}
+
+/*
+ *tree shape for .stats: nodes per level and how full they are, collected by
+ *walking the whole tree on demand
+ */
+#define STATS_FILL_BUCKETS 10
+typedef struct {
+    uint64_t nodes;
+    uint64_t entries;  // cells of a leaf, children of an internal node
+    uint64_t fill[STATS_FILL_BUCKETS];  // nodes by tenth of capacity used
+} level_shape;
+struct {
+    uint32_t height;
+    level_shape levels[STATS_MAX_HEIGHT];  // by depth, the root is 0
+} tree_shape;
+
+// count a node with `entries` of `capacity` used, `depth` below the root
+void tree_shape_add(uint32_t depth, uint32_t entries, uint32_t capacity) {
+    if (depth + 1 > tree_shape.height) {
+        tree_shape.height = depth + 1;
+    }
+    level_shape* level = &tree_shape.levels[depth];
+    uint32_t bucket = (uint64_t)entries * STATS_FILL_BUCKETS / capacity;
+    level->nodes++;
+    level->entries += entries;
+    level->fill[bucket < STATS_FILL_BUCKETS ? bucket : STATS_FILL_BUCKETS - 1]++;
+}
+
+void walk_tree_shape(uint32_t page_num, uint32_t depth) {
+    if (depth >= STATS_MAX_HEIGHT) {
+        return;
+    }
+    void* node = get_page(page_num);
+    if (get_node_type(node) == NODE_LEAF) {
+        tree_shape_add(depth, ((leaf_node*)node)->num_cells,
+                       table.leaf_node_max_cells);
+        return;
+    }
+    uint32_t entries = ((internal_node*)node)->num_keys + 1;
+    tree_shape_add(depth, entries, table.internal_node_max_cells);
+    for (uint32_t i = 0; i < entries; i++) {
+        // re-fetch, the walk below may have recycled the frame
+        node = get_page(page_num);
+        walk_tree_shape(*internal_node_child(node, i), depth + 1);
+    }
+}
+
+// the trees of all partitions add up level by level
+void collect_tree_shape() {
+    memset(&tree_shape, 0, sizeof(tree_shape));
+    for (uint32_t i = 0; i < partitions.count; i++) {
+        partition_use(i);
+        walk_tree_shape(table.root_page_num, 0);
+    }
+}
+
+// capacity of a node `depth` levels below the root
+uint32_t level_capacity(uint32_t depth) {
+    return depth + 1 == tree_shape.height ? table.leaf_node_max_cells
+                                          : table.internal_node_max_cells;
+}
+
+void print_tree_shape() {
+    output_message("tree: height %u, leaves are level 0\n", tree_shape.height);
+    for (uint32_t depth = 0; depth < tree_shape.height; depth++) {
+        level_shape* level = &tree_shape.levels[depth];
+        output_message("  level %u: %llu nodes, %.1f%% full, deciles",
+                       tree_shape.height - 1 - depth,
+                       (unsigned long long)level->nodes,
+                       100.0 * level->entries /
+                           (level->nodes * level_capacity(depth)));
+        for (uint32_t i = 0; i < STATS_FILL_BUCKETS; i++) {
+            output_message(" %llu", (unsigned long long)level->fill[i]);
+        }
+        output_message("\n");
+    }
+}
+
+void print_stats() {
+    static const char* names[] = {"insert", "select", "delete"};
+    uint64_t lookups = pager.hits + pager.misses;
+    output_message("pager: %llu hits, %llu misses, %llu evictions (%.1f%% hit)\n",
+                   (unsigned long long)pager.hits,
+                   (unsigned long long)pager.misses,
+                   (unsigned long long)pager.evictions,
+                   lookups > 0 ? 100.0 * pager.hits / lookups : 0.0);
+    output_message("pages: %llu read, %llu written\n",
+                   (unsigned long long)pager.pages_read,
+                   (unsigned long long)pager.pages_written);
+    output_message("cursors: %llu allocated\n",
+                   (unsigned long long)stats.cursors);
+    output_message("b summaries: %llu leaves skipped\n",
+                   (unsigned long long)stats.leaves_skipped);
+    if (memtable.capacity > 0) {
+        output_message(
+            "memtable: %u of %u rows, %u merging, %llu merged, %llu stalls\n",
+            memtable.active->size - 1, memtable.capacity,
+            memtable.immutable ? memtable.immutable->size - 1 : 0,
+            (unsigned long long)memtable.rows_merged,
+            (unsigned long long)memtable.stalls);
+    }
+    if (flusher.running) {
+        output_message("flusher: %llu pages written, %llu checkpoints, "
+                       "%llu evictions of dirty pages\n",
+                       (unsigned long long)flusher.pages_written,
+                       (unsigned long long)flusher.checkpoints,
+                       (unsigned long long)flusher.eviction_writes);
+    }
+    output_message("splits: %llu root\n", (unsigned long long)stats.root_splits);
+    for (uint32_t i = 0; i < STATS_MAX_HEIGHT; i++) {
+        if (stats.splits[i] > 0) {
+            output_message("  level %u: %llu\n", i,
+                           (unsigned long long)stats.splits[i]);
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        uint64_t count = stats.count[i];
+        if (count == 0) {
+            continue;
+        }
+        output_message("%s: %llu, %.0f cycles and %.1f rows scanned each\n",
+                       names[i], (unsigned long long)count,
+                       (double)stats.cycles[i] / count,
+                       (double)stats.rows_scanned[i] / count);
+    }
+    for (int i = 0; i < 3; i++) {
+        uint64_t count = stats.requests[i];
+        if (count == 0) {
+            continue;
+        }
+        output_message("%s requests: %llu, %.1f rows scanned each\n",
+                       names[i], (unsigned long long)count,
+                       (double)stats.request_rows_scanned[i] / count);
+    }
+    collect_tree_shape();
+    print_tree_shape();
+}
+
+// print_stats as JSON, tree levels are listed from the leaves up
+void write_stats() {
+    static const char* names[] = {"insert", "select", "delete"};
+    FILE* file = fopen(stats.path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Unable to write stats '%s'.\n", stats.path);
+        return;
+    }
+    fprintf(file,
+            "{\"pager\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,"
+            "\"pages_read\":%llu,\"pages_written\":%llu},\"cursors\":%llu,"
+            "\"leaves_skipped\":%llu,\"root_splits\":%llu,\"splits\":[",
+            (unsigned long long)pager.hits, (unsigned long long)pager.misses,
+            (unsigned long long)pager.evictions,
+            (unsigned long long)pager.pages_read,
+            (unsigned long long)pager.pages_written,
+            (unsigned long long)stats.cursors,
+            (unsigned long long)stats.leaves_skipped,
+            (unsigned long long)stats.root_splits);
+    collect_tree_shape();
+    for (uint32_t i = 0; i < tree_shape.height; i++) {
+        fprintf(file, "%s%llu", i > 0 ? "," : "",
+                (unsigned long long)stats.splits[i]);
+    }
+    fprintf(file, "],\"statements\":{");
+    for (int i = 0; i < 3; i++) {
+        fprintf(file,
+                "%s\"%s\":{\"count\":%llu,\"cycles\":%llu,"
+                "\"rows_scanned\":%llu}",
+                i > 0 ? "," : "", names[i], (unsigned long long)stats.count[i],
+                (unsigned long long)stats.cycles[i],
+                (unsigned long long)stats.rows_scanned[i]);
+    }
+    fprintf(file, "},\"requests\":{");
+    for (int i = 0; i < 3; i++) {
+        fprintf(file, "%s\"%s\":{\"count\":%llu,\"rows_scanned\":%llu}",
+                i > 0 ? "," : "", names[i],
+                (unsigned long long)stats.requests[i],
+                (unsigned long long)stats.request_rows_scanned[i]);
+    }
+    fprintf(file, "},\"tree\":{\"height\":%u,\"levels\":[",
+            tree_shape.height);
+    for (uint32_t i = 0; i < tree_shape.height; i++) {
+        uint32_t depth = tree_shape.height - 1 - i;
+        level_shape* level = &tree_shape.levels[depth];
+        fprintf(file,
+                "%s{\"nodes\":%llu,\"entries\":%llu,\"capacity\":%u,"
+                "\"fill\":[",
+                i > 0 ? "," : "", (unsigned long long)level->nodes,
+                (unsigned long long)level->entries, level_capacity(depth));
+        for (uint32_t j = 0; j < STATS_FILL_BUCKETS; j++) {
+            fprintf(file, "%s%llu", j > 0 ? "," : "",
+                    (unsigned long long)level->fill[j]);
+        }
+        fprintf(file, "]}");
+    }
+    fprintf(file, "]}}\n");
+    fclose(file);
+}
+
+/*
+ *.check: walks every node from the root with the key range its parent
+ *allows, and follows the leaves in tree order to verify the next_leaf chain
+ *a key belongs to child i of an internal node if key[i-1] <= key <= key[i],
+ *rows of one key may continue past the separator into the next child
+ *an error is reported and the walk goes on, so the page counts and the
+ *shape still cover the whole tree
+ */
+#define CHECK_MAX_ERRORS 20
+struct {
+    uint64_t errors;
+    uint64_t duplicates;
+    uint8_t* visited;  // by page_num
+    uint32_t leaf_depth;
+    bool leaf_seen;
+    uint32_t previous_leaf;
+    uint32_t previous_next_leaf;
+    bool key_seen;
+    uint32_t previous_key;  // last key of the leaves so far, in tree order
+    uint64_t empty_leaves;
+    uint64_t leaf_jumps;  // next_leaf is not the following page
+} check;
+
+// only the first errors are printed, all are counted
+void check_error(const char* format, ...) {
+    if (check.errors++ >= CHECK_MAX_ERRORS) {
+        return;
+    }
+    char message[128];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    output_message("  %s\n", message);
+}
+
+void check_leaf(uint32_t page_num, leaf_node* node, uint32_t depth,
+                int64_t low, int64_t high) {
+    uint32_t num_cells = node->num_cells;
+    if (num_cells > table.leaf_node_max_cells) {
+        check_error("page %u: %u cells, at most %u fit", page_num, num_cells,
+                    table.leaf_node_max_cells);
+        num_cells = table.leaf_node_max_cells;
+    }
+    if (!check.leaf_seen) {
+        check.leaf_depth = depth;
+    } else if (depth != check.leaf_depth) {
+        check_error("page %u: leaf at depth %u, others at %u", page_num, depth,
+                    check.leaf_depth);
+    }
+    for (uint32_t i = 0; i < num_cells; i++) {
+        uint32_t key = node->values[i].a;
+        if (key < low || key > high) {
+            check_error("page %u: key %u outside [%lld, %lld]", page_num, key,
+                        (long long)low, (long long)high);
+        }
+        if (check.key_seen && key < check.previous_key) {
+            check_error("page %u: key %u after %u", page_num, key,
+                        check.previous_key);
+        }
+        if (check.key_seen && key == check.previous_key) {
+            check.duplicates++;
+        }
+        check.key_seen = true;
+        check.previous_key = key;
+        if (partition_of(key) != partitions.current) {
+            check_error("page %u: key %u belongs to partition %u", page_num,
+                        key, partition_of(key));
+        }
+    }
+
+    if (check.leaf_seen) {
+        if (check.previous_next_leaf != page_num) {
+            check_error("page %u: next_leaf is %u, expected %u",
+                        check.previous_leaf, check.previous_next_leaf,
+                        page_num);
+        }
+        if (check.previous_leaf + 1 != page_num) {
+            check.leaf_jumps++;
+        }
+    }
+    check.leaf_seen = true;
+    check.previous_leaf = page_num;
+    check.previous_next_leaf = node->next_leaf;
+    if (num_cells == 0) {
+        check.empty_leaves++;
+    }
+    tree_shape_add(depth, num_cells, table.leaf_node_max_cells);
+}
+
+void check_node(uint32_t page_num, uint32_t parent, uint32_t depth,
+                int64_t low, int64_t high) {
+    if (page_num == DB_HEADER_PAGE_NUM || page_num >= pager.num_pages) {
+        check_error("page %u: child %u does not exist", parent, page_num);
+        return;
+    }
+    if (check.visited[page_num]) {
+        check_error("page %u: reached twice, again from %u", page_num, parent);
+        return;
+    }
+    check.visited[page_num] = 1;
+    if (depth >= STATS_MAX_HEIGHT) {
+        check_error("page %u: deeper than %u levels", page_num,
+                    STATS_MAX_HEIGHT);
+        return;
+    }
+
+    void* node = get_page(page_num);
+    bool is_root = page_num == table.root_page_num;
+    if (is_node_root(node) != is_root) {
+        check_error("page %u: is_root is %d", page_num, is_node_root(node));
+    }
+    if (!is_root && *node_parent(node) != parent) {
+        check_error("page %u: parent is %u, expected %u", page_num,
+                    *node_parent(node), parent);
+    }
+    if (get_node_type(node) == NODE_LEAF) {
+        check_leaf(page_num, node, depth, low, high);
+        return;
+    }
+    if (get_node_type(node) != NODE_INTERNAL) {
+        check_error("page %u: unknown node type %u", page_num,
+                    get_node_type(node));
+        return;
+    }
+
+    internal_node* internal = node;
+    uint32_t num_keys = internal->num_keys;
+    if (num_keys == 0 || num_keys >= table.internal_node_max_cells) {
+        check_error("page %u: %u keys, expected 1 to %u", page_num, num_keys,
+                    table.internal_node_max_cells - 1);
+        if (num_keys == 0) {
+            return;
+        }
+        num_keys = table.internal_node_max_cells - 1;
+    }
+    for (uint32_t i = 0; i < num_keys; i++) {
+        int64_t key = internal->body[i].key;
+        int64_t previous = i > 0 ? internal->body[i - 1].key : low;
+        if (key < previous || key > high) {
+            check_error("page %u: key %lld at %u outside [%lld, %lld]",
+                        page_num, (long long)key, i, (long long)previous,
+                        (long long)high);
+        }
+    }
+    tree_shape_add(depth, num_keys + 1, table.internal_node_max_cells);
+
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        // re-fetch, the walk below may have recycled the frame
+        internal = get_page(page_num);
+        int64_t child_low = i > 0 ? internal->body[i - 1].key : low;
+        int64_t child_high = i < num_keys ? internal->body[i].key : high;
+        uint32_t child = i < num_keys ? internal->body[i].child
+                                      : internal->rightest_child;
+        check_node(child, page_num, depth + 1, child_low, child_high);
+    }
+}
+
+// verify the tree and report how well its pages are used
+void check_tree() {
+    memset(&check, 0, sizeof(check));
+    memset(&tree_shape, 0, sizeof(tree_shape));
+    check.visited = calloc(pager.num_pages, 1);
+
+    db_header* header = get_page(DB_HEADER_PAGE_NUM);
+    if (memcmp(header->magic, DB_MAGIC, sizeof(DB_MAGIC)) != 0 ||
+        header->page_size != pager.page_size ||
+        header->root_page_num != table.root_page_num) {
+        check_error("page 0: header does not match the open database");
+    }
+    check_node(table.root_page_num, DB_HEADER_PAGE_NUM, 0, 0, UINT32_MAX);
+    if (check.leaf_seen && check.previous_next_leaf != 0) {
+        check_error("page %u: last leaf, next_leaf is %u",
+                    check.previous_leaf, check.previous_next_leaf);
+    }
+
+    uint32_t reached = 0;
+    for (uint32_t i = 0; i < pager.num_pages; i++) {
+        reached += check.visited[i];
+    }
+    free(check.visited);
+
+    if (check.errors > CHECK_MAX_ERRORS) {
+        output_message("  ... %llu more\n",
+                       (unsigned long long)(check.errors - CHECK_MAX_ERRORS));
+    }
+    output_message("check: %s, %llu errors, %llu duplicate keys\n",
+                   check.errors == 0 ? "ok" : "FAILED",
+                   (unsigned long long)check.errors,
+                   (unsigned long long)check.duplicates);
+    // page 0 is the header
+    output_message("pages: %u in file, %u in the tree, %u unreachable\n",
+                   pager.num_pages, reached, pager.num_pages - 1 - reached);
+    print_tree_shape();
+    if (tree_shape.height == 0) {
+        return;
+    }
+    level_shape* leaves = &tree_shape.levels[tree_shape.height - 1];
+    uint64_t needed = (leaves->entries + table.leaf_node_max_cells - 1) /
+                      table.leaf_node_max_cells;
+    if (needed == 0) {
+        needed = 1;
+    }
+    output_message("leaves: %llu empty, %.1f%% of next_leaf links jump\n",
+                   (unsigned long long)check.empty_leaves,
+                   leaves->nodes > 1
+                       ? 100.0 * check.leaf_jumps / (leaves->nodes - 1)
+                       : 0.0);
+    output_message("full scan: %llu leaves, %llu when full (+%.1f%% I/O)\n",
+                   (unsigned long long)leaves->nodes,
+                   (unsigned long long)needed,
+                   100.0 * (leaves->nodes - needed) / needed);
+}
+
+// the shell's database, opened through libmyjql
+myjql* shell_db;
+
+// last look at the database before it is closed
+void shell_close() {
+    if (stats.path != NULL) {
+        pthread_mutex_lock(&engine_lock);
+        write_stats();
+        pthread_mutex_unlock(&engine_lock);
+    }
+    myjql_close(shell_db);
+}
+
+// end of a successful session, failures exit without the report
+void shell_finish() {
+    report_throughput();
+    output_decoration("bye~\n");
+    output_flush();
 }
 
 /* specialization of data structure */
 
-void print_row(Row* row) { printf("(%d, %s)\n", row->a, row->b); }
+void print_row(Row* row) {
+    if (output.discard_rows) {
+        return;
+    }
+    switch (output.mode) {
+        case OUTPUT_TEXT:
+            output_write("(", 1);
+            output_uint32(row->a);
+            output_write(", ", 2);
+            output_string(row->b);
+            output_write(")\n", 2);
+            break;
+        case OUTPUT_CSV:
+            output_uint32(row->a);
+            output_write(",", 1);
+            if (strpbrk(row->b, ",\"") == NULL) {
+                output_string(row->b);
+            } else {
+                output_write("\"", 1);
+                for (const char* p = row->b; *p; p++) {
+                    if (*p == '"') output_write("\"", 1);
+                    output_write(p, 1);
+                }
+                output_write("\"", 1);
+            }
+            output_write("\n", 1);
+            break;
+        case OUTPUT_BINARY:
+            // 16 byte records: a (native uint32), b (zero padded)
+            output_write(&row->a, A_SIZE);
+            output_write(row->b, B_SIZE);
+            break;
+    }
+}
+
+// single aggregate value, a row with an empty b in binary output
+void print_value(uint32_t value) {
+    if (output.discard_rows) {
+        return;
+    }
+    switch (output.mode) {
+        case OUTPUT_TEXT:
+            output_write("(", 1);
+            output_uint32(value);
+            output_write(")\n", 2);
+            break;
+        case OUTPUT_CSV:
+            output_uint32(value);
+            output_write("\n", 1);
+            break;
+        case OUTPUT_BINARY: {
+            Row row = {value, ""};
+            print_row(&row);
+            break;
+        }
+    }
+}
+
+// only text output marks an empty result
+void print_empty() {
+    if (output.mode == OUTPUT_TEXT && !output.discard_rows) {
+        output_string("(Empty)\n");
+    }
+}
 
 /* statement */
 
@@ -585,11 +2216,89 @@ typedef enum {
     STATEMENT_DELETE
 } StatementType;
 
-struct {
+typedef enum { EXPLAIN_NONE, EXPLAIN_PLAN, EXPLAIN_ANALYZE } ExplainMode;
+
+// `select count(*)`, `select min(a)` ... computed inside the scan
+typedef enum {
+    AGGREGATE_NONE,
+    AGGREGATE_COUNT,
+    AGGREGATE_MIN,
+    AGGREGATE_MAX,
+    AGGREGATE_GROUP_COUNT  // `count(*) group by b`
+} Aggregate;
+
+// what an insert does when the key is already in the table
+typedef enum {
+    CONFLICT_NONE,     // `insert`, keeps both rows
+    CONFLICT_REPLACE,  // `upsert`, `insert or replace`
+    CONFLICT_IGNORE    // `insert or ignore`
+} ConflictMode;
+
+#define NO_LIMIT UINT32_MAX
+
+// `?` in place of a column value, bound through libmyjql
+#define PARAM_A 1
+#define PARAM_B 2
+
+typedef struct {
     StatementType type;
     Row row;
-    uint8_t flag;  // 0: only `insert` or `select`, 1: one arg
-} statement;
+    uint8_t flag;         // 0: only `insert` or `select`, 1: one arg
+    ExplainMode explain;  // `explain [analyze]` prefix
+    ConflictMode conflict;
+    Aggregate aggregate;
+    bool order_by_b;  // `order by b [limit n]`
+    uint32_t limit;   // NO_LIMIT without `limit`
+    uint8_t params;   // PARAM_A | PARAM_B
+} Statement;
+Statement statement;
+
+// the memtables in the order their rows were inserted, NULL if unused
+Memtable* memtable_source(uint32_t index) {
+    return index == 0 ? memtable.immutable : memtable.active;
+}
+
+// first entry with a >= `key`, 0 if there is none
+uint32_t memtable_seek(Memtable* table, uint32_t key) {
+    uint32_t x = 0;
+    for (int32_t level = table->height - 1; level >= 0; level--) {
+        uint32_t next;
+        while ((next = table->entries[x].next[level]) != 0 &&
+               table->entries[next].row.a < key) {
+            x = next;
+        }
+    }
+    return table->entries[x].next[0];
+}
+
+bool memtable_row_matches(memtable_entry* entry, const char* b) {
+    return !entry->deleted && !entry->merged &&
+           (b == NULL || memcmp(entry->row.b, b, B_SIZE) == 0);
+}
+
+// row sources of a select: the partitions, then the immutable and the
+// active memtable
+#define ROW_SOURCES (MAX_PARTITIONS + 2)
+
+// position in the leaf chain of one partition
+typedef struct {
+    uint32_t page_num;  // 0: end of the partition
+    uint32_t cell_num;
+} LeafScan;
+typedef struct {
+    bool filtered;
+    char b[COLUMN_B_SIZE + 1];
+    uint64_t scanned;
+    // range partitions are read one after the other, hash partitions and
+    // memtables are merged on a through the next row of each source
+    uint32_t partition;
+    LeafScan scans[MAX_PARTITIONS];
+    uint32_t memtable_next[2];
+    bool merging;
+    leaf_node_body heads[ROW_SOURCES];
+    bool has_head[ROW_SOURCES];
+    leaf_node_body merged;
+} RowIterator;
 
 /* B-Tree operations */
 
@@ -609,6 +2318,12 @@ Cursor* table_find(uint32_t key) {
 inline Cursor* table_start() {
     Cursor* cursor = table_find(0);
     leaf_node* node = get_page(cursor->page_num);
+    // skip leaves emptied by deletion
+    while (node->num_cells == 0 && node->next_leaf != 0) {
+        cursor->page_num = node->next_leaf;
+        cursor->cell_num = 0;
+        node = get_page(cursor->page_num);
+    }
     uint32_t num_cells = node->num_cells;
     cursor->is_end_of_table = (num_cells == 0);
     return cursor;
@@ -641,31 +2356,171 @@ void cursor_advance(Cursor* cursor) {
     }
 }
 
-// the key to select is stored in `statement.row.b`
-void b_tree_search() {
-    /*printf("[INFO] select: %s\n", statement.row.b);*/
+// first leaf of the chain
+uint32_t leftmost_leaf() {
+    Cursor* cursor = table_find(0);
+    uint32_t page_num = cursor->page_num;
+    free(cursor);
+    return page_num;
+}
 
-    /* print selected rows */
-    int cnt = 0;
-    Cursor* cursor = table_start();
-    Row row;
-    while (!(cursor->is_end_of_table)) {
-        if (memcmp(cursor_value(cursor)->b, statement.row.b, B_SIZE) == 0) {
-            cnt++;
-            deserialize_row(cursor_value(cursor), &row);
-            print_row(&row);
+/*
+ *rows of a select along the leaf chain, optionally only those whose b
+ *matches: leaves the b summaries rule out are skipped
+ *rows are returned in place, a row is valid until the next get_page
+ */
+void leaf_scan_start(RowIterator* rows, LeafScan* scan, uint32_t key) {
+    Cursor* cursor = table_find(key);
+    scan->page_num = cursor->page_num;
+    scan->cell_num = cursor->cell_num;
+    free(cursor);
+    // the search may end on any of equal keys
+    leaf_node* node = get_page(scan->page_num);
+    while (scan->cell_num > 0 && node->values[scan->cell_num - 1].a >= key) {
+        scan->cell_num--;
+    }
+    if (rows->filtered) {
+        uint32_t page_num = leaf_chain_seek(scan->page_num, rows->b);
+        if (page_num != scan->page_num) {
+            scan->page_num = page_num;
+            scan->cell_num = 0;
         }
-        cursor_advance(cursor);
     }
-    free(cursor);
-    if (cnt == 0) {
-        printf("(Empty)\n");
+}
+
+// next row of the partition in the globals, NULL at its end
+leaf_node_body* leaf_scan_next(RowIterator* rows, LeafScan* scan) {
+    while (scan->page_num != 0) {
+        leaf_node* node = rows->filtered ? get_leaf_summarized(scan->page_num)
+                                         : get_page(scan->page_num);
+        if (scan->cell_num == 0) {
+            rows->scanned += node->num_cells;
+        }
+        while (scan->cell_num < node->num_cells) {
+            leaf_node_body* value = &node->values[scan->cell_num++];
+            if (!rows->filtered || memcmp(value->b, rows->b, B_SIZE) == 0) {
+                return value;
+            }
+        }
+        scan->page_num = rows->filtered
+                             ? leaf_chain_seek(node->next_leaf, rows->b)
+                             : node->next_leaf;
+        scan->cell_num = 0;
     }
+    return NULL;
 }
 
-// return index of the child which should contain the key (lower_bound)
-uint32_t internal_node_find_child(internal_node* node, uint32_t key) {
-    int num_keys = node->num_keys;
+// fetch the next row of source `index` into the merge
+void row_iterator_fill(RowIterator* rows, uint32_t index) {
+    if (index >= partitions.count) {
+        Memtable* table = memtable_source(index - partitions.count);
+        uint32_t* next = &rows->memtable_next[index - partitions.count];
+        while (*next != 0 &&
+               !memtable_row_matches(&table->entries[*next],
+                                     rows->filtered ? rows->b : NULL)) {
+            *next = table->entries[*next].next[0];
+        }
+        rows->has_head[index] = *next != 0;
+        if (*next != 0) {
+            serialize_row(&table->entries[*next].row, &rows->heads[index]);
+            *next = table->entries[*next].next[0];
+        }
+        return;
+    }
+    partition_use(index);
+    leaf_node_body* value = leaf_scan_next(rows, &rows->scans[index]);
+    rows->has_head[index] = value != NULL;
+    if (value != NULL) {
+        rows->heads[index] = *value;
+    }
+}
+
+// rows from the first with a >= `key` on
+void row_iterator_start_at(RowIterator* rows, const char* b, uint32_t key) {
+    rows->filtered = b != NULL;
+    if (rows->filtered) {
+        memcpy(rows->b, b, B_SIZE);
+    }
+    rows->scanned = 0;
+    rows->partition = 0;
+    rows->merging =
+        (partitions.count > 1 && partitions.scheme == MYJQL_PARTITION_HASH) ||
+        memtable.immutable != NULL ||
+        (memtable.active != NULL && memtable.active->size > 1);
+    for (uint32_t i = 0; i < partitions.count; i++) {
+        partition_use(i);
+        leaf_scan_start(rows, &rows->scans[i], key);
+        if (rows->merging) {
+            row_iterator_fill(rows, i);
+        }
+    }
+    if (rows->merging) {
+        for (uint32_t i = 0; i < 2; i++) {
+            Memtable* table = memtable_source(i);
+            rows->memtable_next[i] = table ? memtable_seek(table, key) : 0;
+            row_iterator_fill(rows, partitions.count + i);
+        }
+    }
+}
+
+void row_iterator_start(RowIterator* rows, const char* b) {
+    row_iterator_start_at(rows, b, 0);
+}
+
+// next row in order of a, NULL at the end of the table
+// merged rows are copies, valid until the next call
+leaf_node_body* row_iterator_next(RowIterator* rows) {
+    if (!rows->merging) {
+        for (; rows->partition < partitions.count; rows->partition++) {
+            partition_use(rows->partition);
+            leaf_node_body* value =
+                leaf_scan_next(rows, &rows->scans[rows->partition]);
+            if (value != NULL) {
+                return value;
+            }
+        }
+        return NULL;
+    }
+    // few sources, a linear pick of the smallest key is enough, on equal
+    // keys the older source goes first
+    int32_t smallest = -1;
+    for (uint32_t i = 0; i < partitions.count + 2; i++) {
+        if (rows->has_head[i] &&
+            (smallest < 0 || rows->heads[i].a < rows->heads[smallest].a)) {
+            smallest = i;
+        }
+    }
+    if (smallest < 0) {
+        return NULL;
+    }
+    rows->merged = rows->heads[smallest];
+    row_iterator_fill(rows, smallest);
+    return &rows->merged;
+}
+
+// the key to select is stored in `statement.row.b`
+void b_tree_search() {
+    /* print selected rows */
+    int cnt = 0;
+    Row row;
+    RowIterator rows;
+    row_iterator_start(&rows, statement.row.b);
+    leaf_node_body* value;
+    while ((value = row_iterator_next(&rows)) != NULL) {
+        cnt++;
+        deserialize_row(value, &row);
+        print_row(&row);
+    }
+    stats.rows_scanned[STATEMENT_SELECT] += rows.scanned;
+    stats.rows_emitted[STATEMENT_SELECT] += cnt;
+    if (cnt == 0) {
+        print_empty();
+    }
+}
+
+// return index of the child which should contain the key (lower_bound)
+uint32_t internal_node_find_child(internal_node* node, uint32_t key) {
+    int num_keys = node->num_keys;
 
     // binary search to find left boundary
     int left = 0, right = num_keys, mid, key_to_right;
@@ -687,7 +2542,7 @@ Cursor* internal_node_find(uint32_t page_num, uint32_t key) {
     internal_node* node = get_page(page_num);
 
     uint32_t child_index = internal_node_find_child(node, key);
-    uint32_t child_num = node->body[child_index].child;
+    uint32_t child_num = *internal_node_child(node, child_index);
     leaf_node* child = get_page(child_num);
     switch (get_node_type(child)) {
         case NODE_LEAF:
@@ -695,6 +2550,8 @@ Cursor* internal_node_find(uint32_t page_num, uint32_t key) {
         case NODE_INTERNAL:
             return internal_node_find(child_num, key);
     }
+    fprintf(stderr, "Page %u is corrupt.\n", child_num);
+    exit(EXIT_FAILURE);
 }
 // find key on a leaf
 Cursor* leaf_node_find(uint32_t page_num, uint32_t key) {
@@ -703,14 +2560,15 @@ Cursor* leaf_node_find(uint32_t page_num, uint32_t key) {
     uint32_t num_cells = node->num_cells;
 
     Cursor* cursor = malloc(sizeof(Cursor));
+    stats.cursors++;
     cursor->table = &table;
     cursor->page_num = page_num;
     cursor->is_end_of_table = false;
 
     // binary search
-    int left = 0, right = num_cells, mid, key_at_index;
-    while (left <= right) {
-        mid = left + ((right - left) >> 2);
+    uint32_t left = 0, right = num_cells, mid, key_at_index;
+    while (left < right) {
+        mid = left + ((right - left) >> 1);
         key_at_index = node->values[mid].a;
         if (key == key_at_index) {
             cursor->cell_num = mid;
@@ -727,26 +2585,30 @@ Cursor* leaf_node_find(uint32_t page_num, uint32_t key) {
 
 // node is full, need spliting
 void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
+    stats.splits[0]++;
     leaf_node* old_node = get_page(cursor->page_num);
     uint32_t new_page_num = get_unused_page_num();
     leaf_node* new_node = get_page(new_page_num);
+    old_node = get_page(cursor->page_num);
     initialize_leaf_node(new_node);
     // configure parent and siblings for two leaf nodes
     new_node->parent = old_node->parent;
     new_node->next_leaf = old_node->next_leaf;
     old_node->next_leaf = new_page_num;
 
-    uint32_t old_max_key = old_node->values[old_node->num_cells - 1].a;
+    uint32_t left_split_count = table.leaf_node_left_split_count;
 
     // copy data from left to right and insert the new data
-    for (int32_t i = LEAF_NODE_MAX_CELLS; i >= 0; i--) {
+    for (int32_t i = table.leaf_node_max_cells; i >= 0; i--) {
         leaf_node* destination_node;
-        if (i >= LEAF_NODE_LEFT_SPLIT_COUNT) {
+        uint32_t index_within_node;
+        if (i >= left_split_count) {
             destination_node = new_node;
+            index_within_node = i - left_split_count;
         } else {
             destination_node = old_node;
+            index_within_node = i;
         }
-        uint32_t index_within_node = i % LEAF_NODE_LEFT_SPLIT_COUNT;
 
         if (i == cursor->cell_num) {
             serialize_row(value, &destination_node->values[index_within_node]);
@@ -757,46 +2619,30 @@ void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value) {
             destination_node->values[index_within_node] = old_node->values[i];
         }
     }
-    old_node->num_cells = LEAF_NODE_LEFT_SPLIT_COUNT;
-    new_node->num_cells = LEAF_NODE_RIGHT_SPLIT_COUNT;
+    old_node->num_cells = left_split_count;
+    new_node->num_cells = table.leaf_node_right_split_count;
     mark_written(cursor->page_num);
     mark_written(new_page_num);
+    summary_build(cursor->page_num, old_node);
+    summary_build(new_page_num, new_node);
 
     // old node on the left, new node on the right
 
+    uint32_t new_max_key = old_node->values[left_split_count - 1].a;
     if (old_node->is_root) {
         // whole db has only one leaf node as root (initial state)
-        uint32_t new_root_page_num = get_unused_page_num();
-        internal_node* new_root = get_page(new_root_page_num);
-        initialize_internal_node(new_root);
-        new_root->is_root = true;
-        uint32_t left_child_max_key =
-            old_node->values[old_node->num_cells - 1].a;
-        new_root->body[0].key = left_child_max_key;
-        new_root->num_keys = 1;
-        new_root->rightest_child = new_page_num;
-        old_node->parent = new_root_page_num;
-        new_node->parent = new_root_page_num;
-
-        mark_written(new_root_page_num);
+        create_new_root(new_page_num, new_max_key);
     } else {
-        uint32_t parent_page_num = old_node->parent;
-        uint32_t new_max_key = old_node->values[old_node->num_cells - 1].a;
-        internal_node* parent_node = get_page(parent_page_num);
-        update_internal_node_key(parent_node, old_max_key, new_max_key);
-        internal_node_insert(parent_page_num, new_page_num);
-        mark_written(parent_page_num);
+        internal_node_insert(old_node->parent, cursor->page_num, new_page_num,
+                             new_max_key, 1);
     }
 }
 // handle inserting node
 void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
     leaf_node* node = get_page(cursor->page_num);
     uint32_t num_cells = node->num_cells;
-    if (num_cells >= LEAF_NODE_MAX_CELLS) {
+    if (num_cells >= table.leaf_node_max_cells) {
         // node is full
-        /*printf("SPLITTING\n");*/
-        // TODO: split
-        printf("SPLITTING\n");
         leaf_node_split_and_insert(cursor, key, value);
         return;
     }
@@ -809,328 +2655,3182 @@ void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value) {
     node->num_cells += 1;
     mark_written(cursor->page_num);
     serialize_row(value, &node->values[cursor->cell_num]);
+    summary_update(cursor->page_num, node->values[cursor->cell_num].b);
 }
-void b_tree_insert() {
+// insert into the tree, return false if a conflicting row was kept
+bool b_tree_insert_row(Row* row_to_insert, ConflictMode conflict) {
     /* insert a row */
     /*printf("[INFO] insert: ");*/
-    /*print_row(&statement.row);*/
+    /*print_row(row_to_insert);*/
 
-    Row* row_to_insert = &statement.row;
     uint32_t key_to_insert = row_to_insert->a;
+    partition_use(partition_of(key_to_insert));
     Cursor* cursor = table_find(key_to_insert);
 
     leaf_node* node = get_page(cursor->page_num);
     uint32_t num_cells = node->num_cells;
 
-    if (cursor->cell_num < num_cells) {
-        // FIXME: handle duplicate key
+    // plain insert keeps duplicates of a, the others resolve them in the
+    // leaf the descent ended on
+    if (conflict != CONFLICT_NONE && cursor->cell_num < num_cells &&
+        node->values[cursor->cell_num].a == key_to_insert) {
+        bool replace = conflict == CONFLICT_REPLACE;
+        if (replace) {
+            serialize_row(row_to_insert, &node->values[cursor->cell_num]);
+            mark_written(cursor->page_num);
+            summary_update(cursor->page_num, row_to_insert->b);
+        }
+        free(cursor);
+        return replace;
     }
 
     /*printf("cell_num: %d\n", cursor->cell_num);*/
     leaf_node_insert(cursor, row_to_insert->a, row_to_insert);
     free(cursor);
+    return true;
 }
 
-void leaf_node_delete(Cursor* cursor) {
+bool b_tree_contains(uint32_t key) {
+    partition_use(partition_of(key));
+    Cursor* cursor = table_find(key);
     leaf_node* node = get_page(cursor->page_num);
-    if (cursor->cell_num == node->num_cells - 1) {
-        int i = cursor->cell_num - 1;
-        node->values[i].a = 0;
-        node->values[i].b[0] = '\0';
-    } else {
-        for (int i = cursor->cell_num; i < node->num_cells - 1; i++) {
-            node->values[i] = node->values[i + 1];
-        }
-        node->values[node->num_cells - 1].a = 0;
-        node->values[node->num_cells - 1].b[0] = '\0';
+    bool found = cursor->cell_num < node->num_cells &&
+                 node->values[cursor->cell_num].a == key;
+    free(cursor);
+    return found;
+}
+
+/*
+ *rows in order of a are appended to the rightmost leaf of their partition,
+ *a full leaf is followed by a new one that is linked into its parent, so
+ *leaves are filled up instead of being split in halves
+ *equal keys keep their order
+ *return false if `row` sorts before a key of the partition
+ */
+bool b_tree_append_row(Row* row) {
+    partition_use(partition_of(row->a));
+    uint32_t page_num = table.root_page_num;
+    void* node = get_page(page_num);
+    while (get_node_type(node) == NODE_INTERNAL) {
+        page_num = ((internal_node*)node)->rightest_child;
+        node = get_page(page_num);
+    }
+    leaf_node* leaf = node;
+    uint32_t num_cells = leaf->num_cells;
+    // an empty leaf after deletes gives no bound on the keys to its left
+    if (num_cells == 0 ? !leaf->is_root
+                       : leaf->values[num_cells - 1].a > row->a) {
+        return false;
+    }
+    if (num_cells < table.leaf_node_max_cells) {
+        serialize_row(row, &leaf->values[num_cells]);
+        leaf->num_cells++;
+        mark_written(page_num);
+        summary_update(page_num, row->b);
+        return true;
     }
-    node->values[node->num_cells - 1].a = 0;
-    node->values[node->num_cells - 1].b[0] = '\0';
-    node->num_cells -= 1;
 
-    // TODO: handle after deletion
+    uint32_t max_key = leaf->values[num_cells - 1].a;
+    uint32_t parent_page_num = leaf->parent;
+    bool is_root = leaf->is_root;
+    uint32_t new_page_num = get_unused_page_num();
+    leaf->next_leaf = new_page_num;
+    mark_written(page_num);
+    // the values of the full leaf are unchanged, only its link moves on
+    if (page_num < summaries.capacity && summaries.leaves[page_num].valid) {
+        summaries.leaves[page_num].next_leaf = new_page_num;
+    }
+    leaf_node* new_leaf = get_page(new_page_num);
+    initialize_leaf_node(new_leaf);
+    new_leaf->parent = parent_page_num;
+    serialize_row(row, &new_leaf->values[0]);
+    new_leaf->num_cells = 1;
+    mark_written(new_page_num);
+    summary_invalidate(new_page_num);
+    if (is_root) {
+        create_new_root(new_page_num, max_key);
+    } else {
+        internal_node_insert(parent_page_num, page_num, new_page_num, max_key,
+                             1);
+    }
+    return true;
 }
 
-/* the key to delete is stored in `statement.row.b` */
-void b_tree_delete() {
-    /*printf("[INFO] delete: %s\n", statement.row.b);*/
+/* memtable */
 
-    Cursor* cursor = table_start();
-    Row row;
-    uint32_t page_num;
-    leaf_node* node;
-    while (!(cursor->is_end_of_table)) {
-        if (strcmp(cursor_value(cursor)->b, statement.row.b) == 0) {
-            leaf_node_delete(cursor);
-            if (cursor->cell_num >= (node->num_cells)) {
-                /*printf("ADVANCING\n");*/
-                // advance into next leaf node
-                uint32_t next_page_num = node->next_leaf;
-                if (next_page_num == 0) {
-                    // already last node
-                    cursor->is_end_of_table = true;
-                } else {
-                    cursor->page_num = next_page_num;
-                    node = get_page(cursor->page_num);
-                    cursor->cell_num = 0;
-                }
-                continue;
-            }
-        }
-        cursor_advance(cursor);
-        node = get_page(cursor->page_num);
-    }
-    free(cursor);
+uint32_t memtable_random_height() {
+    static uint64_t state = 0x9E3779B97F4A7C15ULL;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    // each level holds half of the level below
+    return 1 + __builtin_ctzll(state | (1ULL << (MEMTABLE_MAX_HEIGHT - 1)));
 }
 
-void b_tree_traverse() {
-    /*printf("[INFO] traverse\n");*/
+void memtable_clear(Memtable* table) {
+    if (table->entries == NULL) {
+        table->entries =
+            malloc((memtable.capacity + 1) * sizeof(memtable_entry));
+    }
+    memset(&table->entries[0], 0, sizeof(memtable_entry));
+    table->size = 1;
+    table->height = 1;
+    table->merge_next = 0;
+}
 
-    Cursor* cursor = table_start();
-    Row row;
-    int cnt = 0;
-    while (!(cursor->is_end_of_table)) {
-        cnt++;
-        deserialize_row(cursor_value(cursor), &row);
-        if (strlen(row.b) > 0) {
-            print_row(&row);
+// insert after the rows with the same key, duplicates keep their order
+void memtable_put(Memtable* table, Row* row) {
+    uint32_t update[MEMTABLE_MAX_HEIGHT];
+    uint32_t x = 0;
+    for (int32_t level = table->height - 1; level >= 0; level--) {
+        uint32_t next;
+        while ((next = table->entries[x].next[level]) != 0 &&
+               table->entries[next].row.a <= row->a) {
+            x = next;
         }
-        cursor_advance(cursor);
+        update[level] = x;
     }
-    free(cursor);
-    if (cnt == 0) {
-        printf("(Empty)\n");
+    uint32_t height = memtable_random_height();
+    for (; table->height < height; table->height++) {
+        update[table->height] = 0;
+    }
+    uint32_t index = table->size++;
+    memtable_entry* entry = &table->entries[index];
+    entry->row = *row;
+    entry->deleted = false;
+    entry->merged = false;
+    for (uint32_t level = 0; level < height; level++) {
+        entry->next[level] = table->entries[update[level]].next[level];
+        table->entries[update[level]].next[level] = index;
     }
 }
 
-/* logic starts */
-
-typedef enum { EXECUTE_SUCCESS } ExecuteResult;
-
-typedef enum {
-    META_COMMAND_SUCCESS,
-    META_COMMAND_UNRECOGNIZED_COMMAND
-} MetaCommandResult;
-
-typedef enum {
-    PREPARE_SUCCESS,
-    PREPARE_NEGATIVE_VALUE,
-    PREPARE_STRING_TOO_LONG,
-    PREPARE_SYNTAX_ERROR,
-    PREPARE_UNRECOGNIZED_STATEMENT,
-    PREPARE_EMPTY_STATEMENT
-} PrepareResult;
-
-void pager_flush(uint32_t page_num) {
-    if (pager.pages[page_num].storage == NULL) {
-        // FIXME: handle flush null page
+// first row with `key` that is neither deleted nor merged
+memtable_entry* memtable_find(Memtable* table, uint32_t key) {
+    if (table == NULL) {
+        return NULL;
+    }
+    for (uint32_t x = memtable_seek(table, key);
+         x != 0 && table->entries[x].row.a == key;
+         x = table->entries[x].next[0]) {
+        if (memtable_row_matches(&table->entries[x], NULL)) {
+            return &table->entries[x];
+        }
     }
+    return NULL;
+}
 
-    off_t offset = lseek(pager.file_descriptor,
-                         pager.pages[page_num].page_num * PAGE_SIZE, SEEK_SET);
-    if (offset == -1) {
-        // FIXME: handle error seeking
+// insert up to `limit` rows of the immutable memtable into the tree
+void memtable_merge(uint32_t limit) {
+    Memtable* table = memtable.immutable;
+    for (; limit > 0 && table->merge_next != 0; limit--) {
+        memtable_entry* entry = &table->entries[table->merge_next];
+        if (!entry->deleted) {
+            b_tree_insert_row(&entry->row, CONFLICT_NONE);
+        }
+        entry->merged = true;
+        memtable.rows_merged++;
+        table->merge_next = entry->next[0];
     }
-    ssize_t bytes_written =
-        write(pager.file_descriptor, pager.pages[page_num].storage, PAGE_SIZE);
-    if (bytes_written == -1) {
-        // FIXME: handle error writing
+    if (table->merge_next == 0) {
+        memtable.immutable = NULL;
     }
 }
 
-void db_close() {
-    for (uint32_t i = 0; i < pager.num_pages; i++) {
-        if (pager.pages[i].storage == NULL) {
+// the active memtable is full: it becomes immutable and is merged by the
+// merger thread, if the previous one is still being merged the statement
+// finishes that merge first
+void memtable_rotate() {
+    if (memtable.immutable != NULL) {
+        memtable.stalls++;
+        memtable_merge(UINT32_MAX);
+    }
+    Memtable* full = memtable.active;
+    full->merge_next = full->entries[0].next[0];
+    memtable.immutable = full->merge_next != 0 ? full : NULL;
+    memtable.active = full == &memtable.tables[0] ? &memtable.tables[1]
+                                                   : &memtable.tables[0];
+    memtable_clear(memtable.active);
+    pthread_cond_broadcast(&memtable.changed);
+}
+
+void* memtable_merger(void* arg) {
+    pthread_mutex_lock(&engine_lock);
+    while (!memtable.stopping) {
+        if (memtable.immutable == NULL || memtable.pinned > 0) {
+            pthread_cond_wait(&memtable.changed, &engine_lock);
             continue;
         }
-        pager_flush(i);
-        free(pager.pages[i].storage);
-        pager.pages[i].storage = NULL;
+        memtable_merge(MEMTABLE_MERGE_SLICE);
+        // statements get the lock between slices
+        pthread_mutex_unlock(&engine_lock);
+        sched_yield();
+        pthread_mutex_lock(&engine_lock);
     }
+    pthread_mutex_unlock(&engine_lock);
+    return NULL;
+}
 
-    int result = close(pager.file_descriptor);
-    if (result == -1) {
-        // FIXME: handle close error
+// rows go to the memtable, the conflicts of `insert or ignore` and `upsert`
+// are resolved against both memtables and the tree
+// return false if a conflicting row was kept
+bool memtable_insert(Row* row, ConflictMode conflict) {
+    if (conflict != CONFLICT_NONE) {
+        memtable_entry* entry = memtable_find(memtable.active, row->a);
+        if (entry == NULL) {
+            entry = memtable_find(memtable.immutable, row->a);
+        }
+        if (entry != NULL) {
+            if (conflict == CONFLICT_REPLACE) {
+                entry->row = *row;
+            }
+            return conflict == CONFLICT_REPLACE;
+        }
+        // already in the tree: replaced in place or kept
+        if (b_tree_contains(row->a)) {
+            return b_tree_insert_row(row, conflict);
+        }
+    }
+    if (memtable.active->size == memtable.capacity + 1) {
+        memtable_rotate();
     }
+    memtable_put(memtable.active, row);
+    return true;
+}
 
-    // check if there is any dirty page unhandled above
-    for (uint32_t i = 0; i < TABLE_MAX_PAGES; i++) {
-        void* page = pager.pages[i].storage;
-        if (page) {
-            free(page);
-            pager.pages[i].storage = NULL;
+// mark the rows whose b matches deleted, return how many
+uint64_t memtable_delete(const char* b) {
+    uint64_t deleted = 0;
+    for (uint32_t i = 0; i < 2; i++) {
+        Memtable* table = memtable_source(i);
+        if (table == NULL) {
+            continue;
+        }
+        for (uint32_t x = table->entries[0].next[0]; x != 0;
+             x = table->entries[x].next[0]) {
+            if (memtable_row_matches(&table->entries[x], b)) {
+                table->entries[x].deleted = true;
+                deleted++;
+            }
         }
     }
+    return deleted;
 }
 
-MetaCommandResult do_meta_command() {
-    if (strcmp(input_buffer.buffer, ".exit") == 0) {
-        db_close();
-        exit(EXIT_SUCCESS);
-    } else {
-        return META_COMMAND_UNRECOGNIZED_COMMAND;
+void memtable_open(uint32_t capacity) {
+    memtable.capacity = capacity;
+    if (capacity == 0) {
+        return;
     }
+    memtable.active = &memtable.tables[0];
+    memtable_clear(memtable.active);
+    memtable.stopping = false;
+    pthread_create(&memtable.merger, NULL, memtable_merger, NULL);
 }
 
-PrepareResult prepare_insert() {
-    statement.type = STATEMENT_INSERT;
-
-    char* keyword = strtok(input_buffer.buffer, " ");
-    char* a = strtok(NULL, " ");
-    char* b = strtok(NULL, " ");
-    int x;
-
-    if (a == NULL || b == NULL) return PREPARE_SYNTAX_ERROR;
-
-    x = atoi(a);
-    if (x < 0) return PREPARE_NEGATIVE_VALUE;
-    if (strlen(b) > COLUMN_B_SIZE) return PREPARE_STRING_TOO_LONG;
+// move every memtable row into the tree
+void memtable_merge_all() {
+    if (memtable.capacity == 0) {
+        return;
+    }
+    if (memtable.immutable != NULL) {
+        memtable_merge(UINT32_MAX);
+    }
+    memtable_rotate();
+    if (memtable.immutable != NULL) {
+        memtable_merge(UINT32_MAX);
+    }
+}
 
-    statement.row.a = x;
-    strcpy(statement.row.b, b);
+// stop the merger and merge what is left, before the tree is closed
+void memtable_close() {
+    if (memtable.capacity == 0) {
+        return;
+    }
+    pthread_mutex_lock(&engine_lock);
+    memtable.stopping = true;
+    pthread_cond_broadcast(&memtable.changed);
+    pthread_mutex_unlock(&engine_lock);
+    pthread_join(memtable.merger, NULL);
 
-    return PREPARE_SUCCESS;
+    memtable_merge_all();
+    for (uint32_t i = 0; i < 2; i++) {
+        free(memtable.tables[i].entries);
+        memtable.tables[i].entries = NULL;
+    }
+    memtable.active = NULL;
+    memtable.capacity = 0;
 }
 
-PrepareResult prepare_condition() {
-    statement.flag = 0;
+void b_tree_insert() {
+    bool inserted = memtable.capacity > 0
+                        ? memtable_insert(&statement.row, statement.conflict)
+                        : b_tree_insert_row(&statement.row, statement.conflict);
+    if (inserted) {
+        stats.rows_emitted[STATEMENT_INSERT]++;
+    }
+}
 
-    char* keyword = strtok(input_buffer.buffer, " ");
-    char* b = strtok(NULL, " ");
-    char* c = strtok(NULL, " ");
+void leaf_node_delete(Cursor* cursor) {
+    leaf_node* node = get_page(cursor->page_num);
+    uint32_t num_cells = node->num_cells;
+    memmove(&node->values[cursor->cell_num],
+            &node->values[cursor->cell_num + 1],
+            (num_cells - cursor->cell_num - 1) * sizeof(leaf_node_body));
+    memset(&node->values[num_cells - 1], 0, sizeof(leaf_node_body));
+    node->num_cells -= 1;
+    mark_written(cursor->page_num);
+}
 
-    if (b == NULL) return PREPARE_SUCCESS;
-    if (c != NULL) return PREPARE_SYNTAX_ERROR;
+// drop every cell whose b matches in one pass, the page is written once
+// return number of cells removed
+uint32_t leaf_node_delete_matching(uint32_t page_num, const char* b) {
+    leaf_node* node = get_page(page_num);
+    uint32_t num_cells = node->num_cells;
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < num_cells; i++) {
+        if (memcmp(node->values[i].b, b, B_SIZE) == 0) {
+            continue;
+        }
+        if (kept != i) {
+            node->values[kept] = node->values[i];
+        }
+        kept++;
+    }
+    if (kept == num_cells) {
+        return 0;
+    }
+    // freed cells are zeroed, they compress better than stale rows
+    memset(&node->values[kept], 0, (num_cells - kept) * sizeof(leaf_node_body));
+    node->num_cells = kept;
+    mark_written(page_num);
+    summary_build(page_num, node);
+    return num_cells - kept;
+}
 
-    if (strlen(b) > COLUMN_B_SIZE) return PREPARE_STRING_TOO_LONG;
+/*
+ *the key to delete is stored in `statement.row.b`
+ *every leaf is compacted once, parent keys are upper bounds and stay valid
+ *when a leaf shrinks, so they are left alone
+ */
+void b_tree_delete() {
+    uint64_t scanned = 0, deleted = 0;
+    for (uint32_t i = 0; i < partitions.count; i++) {
+        partition_use(i);
+        uint32_t page_num = leaf_chain_seek(leftmost_leaf(), statement.row.b);
+        while (page_num != 0) {
+            leaf_node* node = get_leaf_summarized(page_num);
+            scanned += node->num_cells;
+            deleted += leaf_node_delete_matching(page_num, statement.row.b);
+            node = get_page(page_num);
+            page_num = leaf_chain_seek(node->next_leaf, statement.row.b);
+        }
+    }
+    if (memtable.capacity > 0) {
+        deleted += memtable_delete(statement.row.b);
+    }
+    stats.rows_scanned[STATEMENT_DELETE] += scanned;
+    stats.rows_emitted[STATEMENT_DELETE] += deleted;
+}
 
-    strcpy(statement.row.b, b);
+void b_tree_traverse() {
+    /*printf("[INFO] traverse\n");*/
 
-    if (b != NULL) {
-        statement.flag = 1;
+    Row row;
+    RowIterator rows;
+    row_iterator_start(&rows, NULL);
+    leaf_node_body* value;
+    int cnt = 0;
+    uint64_t emitted = 0;
+    while ((value = row_iterator_next(&rows)) != NULL) {
+        cnt++;
+        deserialize_row(value, &row);
+        if (strlen(row.b) > 0) {
+            emitted++;
+            print_row(&row);
+        }
+    }
+    stats.rows_scanned[STATEMENT_SELECT] += cnt;
+    stats.rows_emitted[STATEMENT_SELECT] += emitted;
+    if (cnt == 0) {
+        print_empty();
     }
-
-    return PREPARE_SUCCESS;
 }
 
-PrepareResult prepare_select() {
-    statement.type = STATEMENT_SELECT;
-    return prepare_condition();
-}
+/*
+ *aggregates: rows are never materialized, leaves are read in place
+ */
 
-PrepareResult prepare_delete() {
-    statement.type = STATEMENT_DELETE;
-    PrepareResult result = prepare_condition();
-    if (result == PREPARE_SUCCESS && statement.flag == 0)
-        return PREPARE_SYNTAX_ERROR;
-    return result;
+// smallest or largest key under `page_num`, children are visited from that
+// end so leaves emptied by deletion are passed over
+bool node_extreme_key(uint32_t page_num, bool largest, uint32_t* key) {
+    void* node = get_page(page_num);
+    if (get_node_type(node) == NODE_LEAF) {
+        leaf_node* leaf = node;
+        stats.rows_scanned[STATEMENT_SELECT] += leaf->num_cells > 0;
+        if (leaf->num_cells == 0) {
+            return false;
+        }
+        *key = leaf->values[largest ? leaf->num_cells - 1 : 0].a;
+        return true;
+    }
+    uint32_t num_keys = ((internal_node*)node)->num_keys;
+    for (uint32_t i = 0; i <= num_keys; i++) {
+        // re-fetch, the walk below may have recycled the frame
+        node = get_page(page_num);
+        uint32_t child = *internal_node_child(node, largest ? num_keys - i : i);
+        if (node_extreme_key(child, largest, key)) {
+            return true;
+        }
+    }
+    return false;
 }
 
-PrepareResult prepare_statement() {
-    if (strlen(input_buffer.buffer) == 0) {
-        return PREPARE_EMPTY_STATEMENT;
-    } else if (strncmp(input_buffer.buffer, "insert", 6) == 0) {
-        return prepare_insert();
-    } else if (strncmp(input_buffer.buffer, "select", 6) == 0) {
-        return prepare_select();
-    } else if (strncmp(input_buffer.buffer, "delete", 6) == 0) {
-        return prepare_delete();
+// count(*), min(a), max(a) of the partition in the globals
+bool partition_aggregate_value(uint32_t* value) {
+    Aggregate aggregate = statement.aggregate;
+    if (statement.flag == 0 && aggregate != AGGREGATE_COUNT) {
+        return node_extreme_key(table.root_page_num,
+                                aggregate == AGGREGATE_MAX, value);
     }
-    return PREPARE_UNRECOGNIZED_STATEMENT;
-}
 
-ExecuteResult execute_select() {
-    printf("\n");
+    uint64_t count = 0, scanned = 0;
+    uint32_t key = 0;
+    uint32_t page_num = leftmost_leaf();
     if (statement.flag == 0) {
-        b_tree_traverse();
+        // only the cell counts are needed
+        do {
+            leaf_node* node = get_page(page_num);
+            count += node->num_cells;
+            page_num = node->next_leaf;
+        } while (page_num != 0);
     } else {
-        b_tree_search();
+        page_num = leaf_chain_seek(page_num, statement.row.b);
+        while (page_num != 0) {
+            leaf_node* node = get_leaf_summarized(page_num);
+            scanned += node->num_cells;
+            for (uint32_t i = 0; i < node->num_cells; i++) {
+                if (memcmp(node->values[i].b, statement.row.b, B_SIZE) == 0) {
+                    count++;
+                    key = node->values[i].a;
+                    // keys ascend along the chain, the first match is min
+                    if (aggregate == AGGREGATE_MIN) {
+                        break;
+                    }
+                }
+            }
+            if (aggregate == AGGREGATE_MIN && count > 0) {
+                break;
+            }
+            page_num = leaf_chain_seek(node->next_leaf, statement.row.b);
+        }
     }
-    return EXECUTE_SUCCESS;
+
+    stats.rows_scanned[STATEMENT_SELECT] += scanned;
+    *value = aggregate == AGGREGATE_COUNT ? count : key;
+    return aggregate == AGGREGATE_COUNT || count > 0;
 }
 
-ExecuteResult execute_statement() {
-    static int cnt = 0;
-    cnt++;
-    if (cnt == 6469) {
-        printf("\n(Empty)\n");
-        return EXECUTE_SUCCESS;
+// the same over the rows of memtable `index`, the list is in key order
+bool memtable_aggregate_value(uint32_t index, uint32_t* value) {
+    Memtable* table = memtable_source(index);
+    if (table == NULL) {
+        *value = 0;
+        return statement.aggregate == AGGREGATE_COUNT;
     }
-    switch (statement.type) {
-        case STATEMENT_INSERT:
-            b_tree_insert();
-            return EXECUTE_SUCCESS;
-        case STATEMENT_SELECT:
-            return execute_select();
-        case STATEMENT_DELETE:
-            b_tree_delete();
-            return EXECUTE_SUCCESS;
+    const char* b = statement.flag ? statement.row.b : NULL;
+    uint64_t count = 0, scanned = 0;
+    for (uint32_t x = table->entries[0].next[0]; x != 0;
+         x = table->entries[x].next[0]) {
+        scanned++;
+        if (memtable_row_matches(&table->entries[x], b)) {
+            count++;
+            *value = table->entries[x].row.a;
+            if (statement.aggregate == AGGREGATE_MIN) {
+                break;
+            }
+        }
     }
+    stats.rows_scanned[STATEMENT_SELECT] += scanned;
+    if (statement.aggregate == AGGREGATE_COUNT) {
+        *value = count;
+    }
+    return statement.aggregate == AGGREGATE_COUNT || count > 0;
 }
 
-void sigint_handler(int signum) {
-    printf("\n");
-    exit(EXIT_SUCCESS);
+// count(*), min(a), max(a), optionally over rows whose b matches
+// return false when there is no min or max
+bool aggregate_value(uint32_t* value) {
+    Aggregate aggregate = statement.aggregate;
+    uint64_t count = 0;
+    bool found = false;
+    uint32_t sources = partitions.count + (memtable.capacity > 0 ? 2 : 0);
+    for (uint32_t i = 0; i < sources; i++) {
+        uint32_t partial;
+        bool has_value;
+        if (i < partitions.count) {
+            partition_use(i);
+            has_value = partition_aggregate_value(&partial);
+        } else {
+            has_value = memtable_aggregate_value(i - partitions.count, &partial);
+        }
+        if (!has_value) {
+            continue;
+        }
+        if (aggregate == AGGREGATE_COUNT) {
+            count += partial;
+        } else if (!found || (aggregate == AGGREGATE_MIN) == (partial < *value)) {
+            *value = partial;
+        }
+        found = true;
+    }
+    if (aggregate == AGGREGATE_COUNT) {
+        *value = count;
+    }
+    return found;
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printf("Must supply a database filename.\n");
-        exit(EXIT_FAILURE);
+void b_tree_aggregate() {
+    uint32_t value;
+    if (aggregate_value(&value)) {
+        stats.rows_emitted[STATEMENT_SELECT]++;
+        print_value(value);
+    } else {
+        print_empty();
     }
+}
 
-    atexit(&exit_success);
-    /*signal(SIGINT, &sigint_handler);*/
-
-    open_file(argv[1]);
+/*
+ *hash aggregation for `count(*) group by b`: groups are counted in an open
+ *addressing table of at most group.memory_limit bytes, rows of new groups
+ *that do not fit are spilled to temporary partition files, which are
+ *aggregated the same way once the table is emitted; past GROUP_MAX_DEPTH
+ *levels of spilling the table grows instead
+ */
+#define GROUP_PARTITIONS 16
+#define GROUP_MAX_DEPTH 8
+#define DEFAULT_GROUP_MEMORY (16 << 20)
+typedef struct {
+    char b[COLUMN_B_SIZE + 1];
+    uint32_t count;  // 0: free slot
+} group_entry;
+struct {
+    size_t memory_limit;  // --group-memory
+    group_entry* entries;
+    uint32_t capacity;  // power of two, at most half of it is used
+    uint32_t size;
+    FILE* partitions[GROUP_PARTITIONS];
+    uint64_t spilled;  // rows written to partitions
+} group = {DEFAULT_GROUP_MEMORY};
 
-    while (1) {
-        print_prompt();
-        switch (read_input()) {
-            case INPUT_SUCCESS:
-                break;
-            case INPUT_TOO_LONG:
-                printf("Input is too long.\n");
-                continue;
+// double the table, past the memory limit
+void group_grow() {
+    group_entry* entries = group.entries;
+    uint32_t capacity = group.capacity;
+    group.capacity *= 2;
+    group.entries = calloc(group.capacity, sizeof(group_entry));
+    uint32_t mask = group.capacity - 1;
+    for (uint32_t i = 0; i < capacity; i++) {
+        if (entries[i].count == 0) {
+            continue;
         }
+        uint32_t slot = hash_b(entries[i].b) & mask;
+        while (group.entries[slot].count != 0) {
+            slot = (slot + 1) & mask;
+        }
+        group.entries[slot] = entries[i];
+    }
+    free(entries);
+}
 
-        if (input_buffer.buffer[0] == '.') {
-            switch (do_meta_command()) {
-                case META_COMMAND_SUCCESS:
-                    continue;
-                case META_COMMAND_UNRECOGNIZED_COMMAND:
-                    printf("Unrecognized command '%s'.\n", input_buffer.buffer);
-                    continue;
+void group_add(const char* b, uint32_t depth) {
+    uint64_t h = hash_b(b);
+    uint32_t mask = group.capacity - 1;
+    for (uint32_t slot = h & mask;; slot = (slot + 1) & mask) {
+        group_entry* entry = &group.entries[slot];
+        if (entry->count == 0) {
+            if (group.size < group.capacity / 2) {
+                memcpy(entry->b, b, B_SIZE);
+                entry->count = 1;
+                group.size++;
+                return;
             }
+            // no hash bits are left to partition on, the table grows so a
+            // probe always ends at a free slot
+            if (depth >= GROUP_MAX_DEPTH) {
+                group_grow();
+                group_add(b, depth);
+                return;
+            }
+            break;
         }
-
-        switch (prepare_statement()) {
-            case PREPARE_SUCCESS:
-                break;
-            case PREPARE_EMPTY_STATEMENT:
-                continue;
-            case PREPARE_NEGATIVE_VALUE:
-                printf("Column `a` must be positive.\n");
-                continue;
-            case PREPARE_STRING_TOO_LONG:
-                printf("String for column `b` is too long.\n");
-                continue;
-            case PREPARE_SYNTAX_ERROR:
-                printf("Syntax error. Could not parse statement.\n");
-                continue;
-            case PREPARE_UNRECOGNIZED_STATEMENT:
-                printf("Unrecognized keyword at start of '%s'.\n",
-                       input_buffer.buffer);
-                continue;
+        if (memcmp(entry->b, b, B_SIZE) == 0) {
+            entry->count++;
+            return;
+        }
+    }
+    // the table is full, every level partitions on the next 4 bits
+    uint32_t partition = (h >> (60 - 4 * depth)) & (GROUP_PARTITIONS - 1);
+    if (group.partitions[partition] == NULL) {
+        group.partitions[partition] = tmpfile();
+        if (group.partitions[partition] == NULL) {
+            fprintf(stderr, "Unable to spill group by.\n");
+            exit(EXIT_FAILURE);
         }
+    }
+    fwrite(b, B_SIZE, 1, group.partitions[partition]);
+    group.spilled++;
+}
 
-        fflush(stdout);
+// print the groups of the table and empty it
+void group_emit() {
+    Row row;
+    for (uint32_t i = 0; i < group.capacity; i++) {
+        group_entry* entry = &group.entries[i];
+        if (entry->count == 0) {
+            continue;
+        }
+        row.a = entry->count;
+        memcpy(row.b, entry->b, B_SIZE);
+        print_row(&row);
+        entry->count = 0;
+    }
+    stats.rows_emitted[STATEMENT_SELECT] += group.size;
+    group.size = 0;
+}
 
-        switch (execute_statement()) {
-            case EXECUTE_SUCCESS:
-                printf("\nExecuted.\n\n");
-                break;
+// aggregate the partitions spilled at `depth`, they may spill again
+void group_drain(uint32_t depth) {
+    FILE* partitions[GROUP_PARTITIONS];
+    memcpy(partitions, group.partitions, sizeof(partitions));
+    memset(group.partitions, 0, sizeof(group.partitions));
+    for (int i = 0; i < GROUP_PARTITIONS; i++) {
+        if (partitions[i] == NULL) {
+            continue;
+        }
+        rewind(partitions[i]);
+        char b[COLUMN_B_SIZE + 1];
+        while (fread(b, B_SIZE, 1, partitions[i]) == 1) {
+            group_add(b, depth + 1);
         }
+        fclose(partitions[i]);
+        group_emit();
+        group_drain(depth + 1);
     }
 }
 
+// groups are printed as (count, b) rows, in no particular order
+void b_tree_group_count() {
+    if (group.entries == NULL) {
+        group.capacity = 1;
+        while (group.capacity * 2 * sizeof(group_entry) <= group.memory_limit) {
+            group.capacity *= 2;
+        }
+        group.entries = calloc(group.capacity, sizeof(group_entry));
+    }
+    uint64_t scanned = 0;
+    for (uint32_t partition = 0; partition < partitions.count; partition++) {
+        partition_use(partition);
+        uint32_t page_num = leftmost_leaf();
+        do {
+            leaf_node* node = get_page(page_num);
+            for (uint32_t i = 0; i < node->num_cells; i++) {
+                group_add(node->values[i].b, 0);
+            }
+            scanned += node->num_cells;
+            page_num = node->next_leaf;
+        } while (page_num != 0);
+    }
+    for (uint32_t i = 0; i < 2 && memtable.capacity > 0; i++) {
+        Memtable* table = memtable_source(i);
+        for (uint32_t x = table ? table->entries[0].next[0] : 0; x != 0;
+             x = table->entries[x].next[0]) {
+            if (memtable_row_matches(&table->entries[x], NULL)) {
+                group_add(table->entries[x].row.b, 0);
+                scanned++;
+            }
+        }
+    }
+    stats.rows_scanned[STATEMENT_SELECT] += scanned;
+
+    bool empty = group.size == 0;
+    group_emit();
+    group_drain(0);
+    if (empty) {
+        print_empty();
+    }
+    // a table that grew is sized from the limit again by the next query
+    if (group.capacity * sizeof(group_entry) > group.memory_limit) {
+        free(group.entries);
+        group.entries = NULL;
+    }
+}
+
+/*
+ *`order by b`: rows are collected in a buffer of at most sort.memory_limit
+ *bytes and sorted on (b, a) by an LSD radix sort over the 12 bytes of b,
+ *which is stable and so keeps rows with equal b in order of a; a full
+ *buffer is written to a temporary file as a sorted run and the runs are
+ *merged through a heap of their next rows
+ *with a `limit` that fits the buffer only the first rows are kept, in a
+ *max-heap that drops every row larger than its top
+ */
+#define DEFAULT_SORT_MEMORY (16 << 20)
+struct {
+    size_t memory_limit;  // --sort-memory
+    leaf_node_body* rows;
+    leaf_node_body* scratch;  // radix passes alternate between the two
+    uint32_t capacity;
+    uint32_t size;
+    FILE** runs;
+    uint32_t num_runs;
+    uint32_t runs_capacity;
+} sort = {DEFAULT_SORT_MEMORY};
+
+int compare_rows_by_b(const leaf_node_body* left, const leaf_node_body* right) {
+    int order = memcmp(left->b, right->b, B_SIZE);
+    if (order != 0) {
+        return order;
+    }
+    return (left->a > right->a) - (left->a < right->a);
+}
+
+void sort_rows_by_b(leaf_node_body* rows, uint32_t size) {
+    if (size < 2) {
+        return;
+    }
+    leaf_node_body* from = rows;
+    leaf_node_body* to = sort.scratch;
+    for (int32_t byte = B_SIZE - 1; byte >= 0; byte--) {
+        uint32_t offsets[256] = {0};
+        for (uint32_t i = 0; i < size; i++) {
+            offsets[(uint8_t)from[i].b[byte]]++;
+        }
+        // zero padding makes many bytes the same in every row
+        if (offsets[(uint8_t)from[0].b[byte]] == size) {
+            continue;
+        }
+        uint32_t total = 0;
+        for (int i = 0; i < 256; i++) {
+            uint32_t count = offsets[i];
+            offsets[i] = total;
+            total += count;
+        }
+        for (uint32_t i = 0; i < size; i++) {
+            to[offsets[(uint8_t)from[i].b[byte]]++] = from[i];
+        }
+        leaf_node_body* swap = from;
+        from = to;
+        to = swap;
+    }
+    if (from != rows) {
+        memcpy(rows, from, size * sizeof(leaf_node_body));
+    }
+}
+
+// write the sorted buffer as a run and empty it
+void sort_spill() {
+    sort_rows_by_b(sort.rows, sort.size);
+    if (sort.num_runs == sort.runs_capacity) {
+        sort.runs_capacity = sort.runs_capacity ? sort.runs_capacity * 2 : 16;
+        sort.runs = realloc(sort.runs, sort.runs_capacity * sizeof(FILE*));
+    }
+    FILE* run = tmpfile();
+    if (run == NULL ||
+        fwrite(sort.rows, sizeof(leaf_node_body), sort.size, run) != sort.size) {
+        fprintf(stderr, "Unable to spill order by.\n");
+        exit(EXIT_FAILURE);
+    }
+    rewind(run);
+    sort.runs[sort.num_runs++] = run;
+    sort.size = 0;
+}
+
+void sort_add(const leaf_node_body* row) {
+    if (sort.size == sort.capacity) {
+        sort_spill();
+    }
+    sort.rows[sort.size++] = *row;
+}
+
+// emit a row of the result, return false once `limit` rows are out
+bool sort_emit(const leaf_node_body* value, uint64_t* emitted) {
+    if (*emitted == statement.limit) {
+        return false;
+    }
+    Row row;
+    deserialize_row((leaf_node_body*)value, &row);
+    print_row(&row);
+    (*emitted)++;
+    return true;
+}
+
+// min-heap of run indices on their head rows
+void sort_sift_down(uint32_t* heap, uint32_t size, leaf_node_body* heads,
+                    uint32_t i) {
+    while (1) {
+        uint32_t smallest = i, left = 2 * i + 1, right = 2 * i + 2;
+        if (left < size &&
+            compare_rows_by_b(&heads[heap[left]], &heads[heap[smallest]]) < 0) {
+            smallest = left;
+        }
+        if (right < size &&
+            compare_rows_by_b(&heads[heap[right]], &heads[heap[smallest]]) < 0) {
+            smallest = right;
+        }
+        if (smallest == i) {
+            return;
+        }
+        uint32_t swap = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = swap;
+        i = smallest;
+    }
+}
+
+// k-way merge of the runs, return the number of rows emitted
+uint64_t sort_merge() {
+    uint32_t k = sort.num_runs;
+    leaf_node_body* heads = malloc(k * sizeof(leaf_node_body));
+    uint32_t* heap = malloc(k * sizeof(uint32_t));
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < k; i++) {
+        if (fread(&heads[i], sizeof(leaf_node_body), 1, sort.runs[i]) == 1) {
+            heap[size++] = i;
+        }
+    }
+    for (uint32_t i = size / 2; i-- > 0;) {
+        sort_sift_down(heap, size, heads, i);
+    }
+    uint64_t emitted = 0;
+    while (size > 0 && sort_emit(&heads[heap[0]], &emitted)) {
+        uint32_t run = heap[0];
+        if (fread(&heads[run], sizeof(leaf_node_body), 1, sort.runs[run]) != 1) {
+            heap[0] = heap[--size];
+        }
+        sort_sift_down(heap, size, heads, 0);
+    }
+    for (uint32_t i = 0; i < k; i++) {
+        fclose(sort.runs[i]);
+    }
+    sort.num_runs = 0;
+    free(heads);
+    free(heap);
+    return emitted;
+}
+
+// max-heap of the `limit` smallest rows, in sort.rows
+void sort_keep_smallest(const leaf_node_body* row) {
+    leaf_node_body* heap = sort.rows;
+    uint32_t i;
+    if (sort.size < statement.limit) {
+        // sift up
+        for (i = sort.size++;
+             i > 0 && compare_rows_by_b(&heap[(i - 1) / 2], row) < 0;
+             i = (i - 1) / 2) {
+            heap[i] = heap[(i - 1) / 2];
+        }
+        heap[i] = *row;
+        return;
+    }
+    if (compare_rows_by_b(row, &heap[0]) >= 0) {
+        return;
+    }
+    // replace the top and sift down
+    for (i = 0;;) {
+        uint32_t largest = 2 * i + 1;
+        if (largest >= sort.size) {
+            break;
+        }
+        if (largest + 1 < sort.size &&
+            compare_rows_by_b(&heap[largest + 1], &heap[largest]) > 0) {
+            largest++;
+        }
+        if (compare_rows_by_b(&heap[largest], row) <= 0) {
+            break;
+        }
+        heap[i] = heap[largest];
+        i = largest;
+    }
+    heap[i] = *row;
+}
+
+// rows are printed in order of b, then a
+void b_tree_sort() {
+    // the top-n heap needs room for a row
+    if (statement.limit == 0) {
+        print_empty();
+        return;
+    }
+    if (sort.rows == NULL) {
+        sort.capacity = sort.memory_limit / (2 * sizeof(leaf_node_body));
+        sort.rows = malloc(sort.capacity * sizeof(leaf_node_body));
+        sort.scratch = malloc(sort.capacity * sizeof(leaf_node_body));
+    }
+    bool top_n = statement.limit <= sort.capacity;
+    RowIterator rows;
+    row_iterator_start(&rows, statement.flag ? statement.row.b : NULL);
+    leaf_node_body* value;
+    uint64_t scanned = 0;
+    while ((value = row_iterator_next(&rows)) != NULL) {
+        scanned++;
+        if (!statement.flag && value->b[0] == 0) {
+            // rows without b are not shown by a plain select either
+            continue;
+        }
+        if (top_n) {
+            sort_keep_smallest(value);
+        } else {
+            sort_add(value);
+        }
+    }
+    stats.rows_scanned[STATEMENT_SELECT] +=
+        statement.flag ? rows.scanned : scanned;
+
+    uint64_t emitted = 0;
+    if (sort.num_runs > 0) {
+        if (sort.size > 0) {
+            sort_spill();
+        }
+        emitted = sort_merge();
+    } else {
+        if (top_n) {
+            // the heap is not in order of a, radix sorting is not enough
+            qsort(sort.rows, sort.size, sizeof(leaf_node_body),
+                  (int (*)(const void*, const void*))compare_rows_by_b);
+        } else {
+            sort_rows_by_b(sort.rows, sort.size);
+        }
+        for (uint32_t i = 0; i < sort.size; i++) {
+            if (!sort_emit(&sort.rows[i], &emitted)) {
+                break;
+            }
+        }
+    }
+    sort.size = 0;
+    stats.rows_emitted[STATEMENT_SELECT] += emitted;
+    if (emitted == 0) {
+        print_empty();
+    }
+}
+
+/* logic starts */
+
+typedef enum { EXECUTE_SUCCESS } ExecuteResult;
+
+typedef enum {
+    META_COMMAND_SUCCESS,
+    META_COMMAND_UNRECOGNIZED_COMMAND
+} MetaCommandResult;
+
+typedef enum {
+    PREPARE_SUCCESS,
+    PREPARE_NEGATIVE_VALUE,
+    PREPARE_STRING_TOO_LONG,
+    PREPARE_SYNTAX_ERROR,
+    PREPARE_UNRECOGNIZED_STATEMENT,
+    PREPARE_EMPTY_STATEMENT,
+    PREPARE_UNBOUND_PARAMETER
+} PrepareResult;
+
+// make sure `page_num` has an entry in the page-location table
+void pager_reserve_location(uint32_t page_num) {
+    if (page_num < pager.locations_capacity) {
+        return;
+    }
+    uint32_t capacity = pager.locations_capacity * 2;
+    if (capacity <= page_num) {
+        capacity = page_num + 1;
+    }
+    pager.locations =
+        realloc(pager.locations, capacity * sizeof(page_location));
+    memset(pager.locations + pager.locations_capacity, 0,
+           (capacity - pager.locations_capacity) * sizeof(page_location));
+    pager.durable = realloc(pager.durable, capacity);
+    memset(pager.durable + pager.locations_capacity, 0,
+           capacity - pager.locations_capacity);
+    pager.locations_capacity = capacity;
+}
+
+void slot_list_push(slot_list* list, uint64_t offset, uint32_t capacity) {
+    if (list->count == list->capacity) {
+        list->capacity = list->capacity ? list->capacity * 2 : 64;
+        list->slots =
+            realloc(list->slots, list->capacity * sizeof(page_location));
+    }
+    list->slots[list->count++] = (page_location){offset, 0, capacity};
+}
+
+void slot_list_free(slot_list* list) {
+    free(list->slots);
+    *list = (slot_list){NULL, 0, 0};
+}
+
+// largest slot a page takes, free space is kept in slots up to this size
+uint32_t pager_max_slot() {
+    return (pager.page_size + PAGE_LOCATION_GRANULE - 1) /
+           PAGE_LOCATION_GRANULE * PAGE_LOCATION_GRANULE;
+}
+
+// space for a page of `capacity` bytes: the smallest free slot it fits in,
+// the rest of which stays free, or the end of the file
+uint64_t pager_take_slot(uint32_t capacity) {
+    uint32_t classes = pager_max_slot() / PAGE_LOCATION_GRANULE;
+    for (uint32_t i = capacity / PAGE_LOCATION_GRANULE; i <= classes; i++) {
+        slot_list* list = &pager.free_slots[i];
+        if (list->count > 0) {
+            page_location slot = list->slots[--list->count];
+            if (slot.capacity > capacity) {
+                uint32_t rest = slot.capacity - capacity;
+                slot_list_push(&pager.free_slots[rest / PAGE_LOCATION_GRANULE],
+                               slot.offset + capacity, rest);
+            }
+            return slot.offset;
+        }
+    }
+    uint64_t offset = pager.data_end;
+    pager.data_end += capacity;
+    return offset;
+}
+
+int compare_slots(const void* left, const void* right) {
+    uint64_t a = ((const page_location*)left)->offset;
+    uint64_t b = ((const page_location*)right)->offset;
+    return (a > b) - (a < b);
+}
+
+/*
+ *free space is not recorded in the file: the gaps between the slots of the
+ *table, the table itself and the end of the file are what earlier sessions
+ *moved pages out of, they become free slots when the file is opened
+ */
+void pager_find_free_slots() {
+    uint32_t count = 0;
+    page_location* used =
+        malloc((pager.locations_capacity + 1) * sizeof(page_location));
+    for (uint32_t i = 0; i < pager.locations_capacity; i++) {
+        if (pager.locations[i].capacity > 0) {
+            used[count++] = pager.locations[i];
+        }
+    }
+    used[count++] = (page_location){
+        pager.plt_offset, 0, pager.plt_num_pages * sizeof(page_location)};
+    qsort(used, count, sizeof(page_location), compare_slots);
+
+    uint64_t position = pager.page_size;
+    for (uint32_t i = 0; i <= count; i++) {
+        uint64_t start = i < count ? used[i].offset : pager.data_end;
+        while (start >= position + PAGE_LOCATION_GRANULE) {
+            uint64_t size = (start - position) / PAGE_LOCATION_GRANULE *
+                            PAGE_LOCATION_GRANULE;
+            if (size > pager_max_slot()) {
+                size = pager_max_slot();
+            }
+            pager_release_slot(&(page_location){position, 0, size}, false);
+            position += size;
+        }
+        if (i < count && used[i].offset + used[i].capacity > position) {
+            position = used[i].offset + used[i].capacity;
+        }
+    }
+    free(used);
+}
+
+// a slot a page moved out of, free right away unless a table on disk or
+// the one being synced points to it
+void pager_release_slot(page_location* location, bool durable) {
+    slot_list* list =
+        durable ? &pager.released
+                : &pager.free_slots[location->capacity / PAGE_LOCATION_GRANULE];
+    slot_list_push(list, location->offset, location->capacity);
+}
+
+// leaves are compressed, internal nodes stay raw since they are few and hot
+// a page that outgrows its reserved space moves to the end of the file
+void pager_flush_compressed(uint32_t frame) {
+    uint32_t original = pager.pages[frame].page_num;
+    void* image = pager.pages[frame].storage;
+    uint32_t length = pager.page_size;
+
+    if (get_node_type(image) == NODE_LEAF) {
+        int size =
+            lz_compress(image, pager.page_size, pager.compress_buffer,
+                        pager.page_size - 1, pager.compression,
+                        pager.compress_workspace);
+        if (size > 0) {
+            image = pager.compress_buffer;
+            length = size;
+        }
+    }
+
+    pager_reserve_location(original);
+    page_location* location = &pager.locations[original];
+    // a slot a table on disk points to is never written over, the page
+    // moves to another one instead
+    if (length > location->capacity || pager.durable[original]) {
+        if (location->capacity > 0) {
+            pager_release_slot(location, pager.durable[original]);
+        }
+        location->capacity = (length + PAGE_LOCATION_GRANULE - 1) /
+                             PAGE_LOCATION_GRANULE * PAGE_LOCATION_GRANULE;
+        location->offset = pager_take_slot(location->capacity);
+        pager.durable[original] = false;
+    }
+    location->length = length;
+
+    if (!pwrite_full(pager.file_descriptor, image, length,
+                     location->offset)) {
+        pager_io_failed("writing", original);
+    }
+}
+
+// write the page in `frame` back, it is clean afterwards
+void pager_flush(uint32_t frame) {
+    Page* page = &pager.pages[frame];
+    pager.pages_written++;
+    pager.dirty--;
+    page->written = false;
+    if (pager.compression && page->page_num != DB_HEADER_PAGE_NUM) {
+        pager_flush_compressed(frame);
+        return;
+    }
+    if (pager.compression) {
+        // the table is switched by pager_sync, never by the cached header
+        db_header* header = page->storage;
+        header->plt_offset = pager.plt_offset;
+        header->plt_num_pages = pager.plt_num_pages;
+    }
+
+    off_t offset = (off_t)page->page_num * pager.page_size;
+    if (!pwrite_full(pager.file_descriptor, page->storage, pager.page_size,
+                     offset)) {
+        pager_io_failed("writing", page->page_num);
+    }
+    // pages past the old end are read back from the file from now on
+    if (offset + pager.page_size > pager.file_length) {
+        pager.file_length = offset + pager.page_size;
+    }
+}
+
+/*
+ *make the pages written so far durable with fdatasync; a compressed file
+ *also gets a new copy of its page-location table, in the spare space of
+ *the previous copy or at the end, never over the table the header points
+ *to: the header is switched to the copy once it is on disk, so after a
+ *crash the header always points to a complete table
+ *with `release_lock` the engine lock is dropped for the writes and syncs,
+ *the table is copied before and `partition` used again after
+ *return false if a write or sync failed
+ */
+bool pager_sync(uint32_t partition, bool release_lock) {
+    int fd = pager.file_descriptor;
+    if (!pager.compression) {
+        if (release_lock) {
+            pthread_mutex_unlock(&engine_lock);
+        }
+        bool synced = fdatasync(fd) == 0;
+        if (release_lock) {
+            pthread_mutex_lock(&engine_lock);
+            partition_use(partition);
+        }
+        return synced;
+    }
+
+    pager_reserve_location(pager.num_pages);
+    uint32_t num_pages = pager.num_pages;
+    size_t plt_size = num_pages * sizeof(page_location);
+    page_location* copy = malloc(plt_size);
+    memcpy(copy, pager.locations, plt_size);
+    // the slots of the copy are kept from now on, the ones released before
+    // are still in the table on disk until the header has moved
+    memset(pager.durable, 1, pager.locations_capacity);
+    for (uint32_t i = 0; i < pager.released.count; i++) {
+        slot_list_push(&pager.syncing, pager.released.slots[i].offset,
+                       pager.released.slots[i].capacity);
+    }
+    pager.released.count = 0;
+    uint64_t offset = pager.plt_spare_offset;
+    if (plt_size > pager.plt_spare_size) {
+        offset = pager.data_end;
+        pager.data_end += plt_size;
+    }
+    pager.plt_spare_size = 0;
+
+    if (release_lock) {
+        pthread_mutex_unlock(&engine_lock);
+    }
+    bool synced =
+        pwrite_full(fd, copy, plt_size, offset) && fdatasync(fd) == 0;
+    free(copy);
+    if (release_lock) {
+        pthread_mutex_lock(&engine_lock);
+        partition_use(partition);
+    }
+    if (!synced) {
+        return false;
+    }
+
+    // under the lock, so a flush of the cached header page writes the same
+    db_header header;
+    synced = pread_full(fd, &header, sizeof(header), 0) == sizeof(header);
+    header.plt_num_pages = num_pages;
+    header.plt_offset = offset;
+    synced = synced && pwrite_full(fd, &header, sizeof(header), 0);
+    if (!synced) {
+        return false;
+    }
+    pager.plt_spare_offset = pager.plt_offset;
+    pager.plt_spare_size = (uint64_t)pager.plt_num_pages * sizeof(page_location);
+    pager.plt_offset = offset;
+    pager.plt_num_pages = num_pages;
+
+    if (release_lock) {
+        pthread_mutex_unlock(&engine_lock);
+    }
+    synced = fdatasync(fd) == 0;
+    if (release_lock) {
+        pthread_mutex_lock(&engine_lock);
+        partition_use(partition);
+    }
+    if (synced) {
+        for (uint32_t i = 0; i < pager.syncing.count; i++) {
+            page_location* slot = &pager.syncing.slots[i];
+            slot_list_push(
+                &pager.free_slots[slot->capacity / PAGE_LOCATION_GRANULE],
+                slot->offset, slot->capacity);
+        }
+        pager.syncing.count = 0;
+    }
+    return synced;
+}
+
+void db_close() {
+    if (pager.in_memory) {
+        pager_close_memory();
+        return;
+    }
+    pager_evict_all();
+    if (pager.compression && !pager_sync(partitions.current, false)) {
+        fprintf(stderr, "Error syncing the database file: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (pager.compression) {
+        // free space is not recorded in the file
+        free(pager.durable);
+        pager.durable = NULL;
+        for (uint32_t i = 0; i < pager.page_size / PAGE_LOCATION_GRANULE + 2;
+             i++) {
+            slot_list_free(&pager.free_slots[i]);
+        }
+        free(pager.free_slots);
+        pager.free_slots = NULL;
+        slot_list_free(&pager.released);
+        slot_list_free(&pager.syncing);
+    }
+
+    // a delayed write error may only show up here
+    if (close(pager.file_descriptor) == -1) {
+        fprintf(stderr, "Error closing the database file: %s\n",
+                strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    pager.file_descriptor = -1;
+}
+
+/* flusher */
+
+int compare_frames_by_page(const void* left, const void* right) {
+    int32_t a = pager.pages[*(const uint32_t*)left].page_num;
+    int32_t b = pager.pages[*(const uint32_t*)right].page_num;
+    return (a > b) - (a < b);
+}
+
+// write up to FLUSHER_BATCH dirty frames of the active pager, in page order
+// from the flush cursor on, until at most `target` are dirty
+// return the number written
+uint32_t flusher_write_batch(uint32_t target) {
+    if (pager.dirty <= target) {
+        return 0;
+    }
+    uint32_t* frames = malloc(pager.dirty * sizeof(uint32_t));
+    uint32_t count = 0;
+    for (uint32_t i = 0; i < pager.num_frames; i++) {
+        if (pager.pages[i].written) {
+            frames[count++] = i;
+        }
+    }
+    qsort(frames, count, sizeof(uint32_t), compare_frames_by_page);
+    uint32_t start = 0;
+    while (start < count &&
+           (uint32_t)pager.pages[frames[start]].page_num < pager.flush_cursor) {
+        start++;
+    }
+    uint32_t limit = pager.dirty - target;
+    if (limit > FLUSHER_BATCH) {
+        limit = FLUSHER_BATCH;
+    }
+    uint32_t written = 0;
+    for (; written < limit; written++) {
+        uint32_t frame = frames[(start + written) % count];
+        pager.flush_cursor = pager.pages[frame].page_num + 1;
+        pager_flush(frame);
+    }
+    free(frames);
+    flusher.pages_written += written;
+    return written;
+}
+
+/*
+ *bring every partition down to the dirty target, or to 0 for a checkpoint,
+ *statements get the lock between batches
+ *a checkpoint then writes the last dirty pages in the same hold of the lock
+ *the page-location table is copied in and syncs the file, so a compressed
+ *file is on disk as of one moment between statements
+ *return true if a checkpoint synced every file
+ */
+bool flusher_pass(bool checkpoint) {
+    bool synced = true;
+    for (uint32_t i = 0; i < partitions.count && !flusher.stopping; i++) {
+        // a checkpoint writes as many pages as were dirty when it started,
+        // pages dirtied meanwhile would keep it from ever finishing
+        partition_use(i);
+        uint32_t budget = pager.dirty;
+        while (!flusher.stopping) {
+            partition_use(i);
+            uint32_t target =
+                checkpoint ? 0
+                           : pager.num_frames * flusher.dirty_target / 100;
+            uint32_t written = flusher_write_batch(target);
+            if (written == 0 || (checkpoint && written >= budget)) {
+                break;
+            }
+            budget -= written;
+            pthread_mutex_unlock(&engine_lock);
+            sched_yield();
+            pthread_mutex_lock(&engine_lock);
+        }
+        if (checkpoint && !flusher.stopping) {
+            while (flusher_write_batch(0) > 0) {
+            }
+            // the file is only closed after the flusher has stopped
+            synced = pager_sync(i, true) && synced;
+        }
+    }
+    return synced && !flusher.stopping;
+}
+
+void timespec_add_ms(struct timespec* time, uint32_t ms) {
+    time->tv_sec += ms / 1000;
+    time->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (time->tv_nsec >= 1000000000) {
+        time->tv_sec++;
+        time->tv_nsec -= 1000000000;
+    }
+}
+
+bool timespec_passed(const struct timespec* time) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec > time->tv_sec ||
+           (now.tv_sec == time->tv_sec && now.tv_nsec >= time->tv_nsec);
+}
+
+void* flusher_run(void* arg) {
+    struct timespec checkpoint_at;
+    clock_gettime(CLOCK_REALTIME, &checkpoint_at);
+    timespec_add_ms(&checkpoint_at, flusher.checkpoint_ms);
+    pthread_mutex_lock(&engine_lock);
+    while (!flusher.stopping) {
+        // woken early by mark_written above the dirty target
+        struct timespec tick;
+        clock_gettime(CLOCK_REALTIME, &tick);
+        timespec_add_ms(&tick, FLUSHER_TICK_MS);
+        pthread_cond_timedwait(&flusher.wake, &engine_lock, &tick);
+
+        uint32_t current = partitions.current;
+        bool checkpoint =
+            flusher.checkpoint_ms > 0 && timespec_passed(&checkpoint_at);
+        bool synced = false;
+        if (checkpoint || flusher.dirty_target > 0) {
+            synced = flusher_pass(checkpoint);
+        }
+        if (checkpoint) {
+            if (synced) {
+                flusher.checkpoints++;
+            }
+            clock_gettime(CLOCK_REALTIME, &checkpoint_at);
+            timespec_add_ms(&checkpoint_at, flusher.checkpoint_ms);
+        }
+        partition_use(current);
+    }
+    pthread_mutex_unlock(&engine_lock);
+    return NULL;
+}
+
+void flusher_open(uint32_t dirty_target, uint32_t checkpoint_ms) {
+    if (dirty_target == 0 && checkpoint_ms == 0) {
+        return;
+    }
+    flusher.dirty_target = dirty_target;
+    flusher.checkpoint_ms = checkpoint_ms;
+    flusher.stopping = false;
+    flusher.running = true;
+    pthread_create(&flusher.thread, NULL, flusher_run, NULL);
+}
+
+void flusher_close() {
+    if (!flusher.running) {
+        return;
+    }
+    pthread_mutex_lock(&engine_lock);
+    flusher.stopping = true;
+    pthread_cond_signal(&flusher.wake);
+    pthread_mutex_unlock(&engine_lock);
+    pthread_join(flusher.thread, NULL);
+    flusher.running = false;
+    flusher.dirty_target = 0;
+    flusher.checkpoint_ms = 0;
+}
+
+/*
+ *.snapshot FILE: the table as an uncompressed database image, pages in
+ *order from the header on, so it opens as a database file or is loaded into
+ *a `:memory:` database with one read; a partitioned table is written as
+ *FILE and FILE.1 .. like its files
+ */
+bool snapshot_write_partition(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        return false;
+    }
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    // the header describes the raw layout
+    db_header* header = malloc(pager.page_size);
+    memcpy(header, get_page(DB_HEADER_PAGE_NUM), pager.page_size);
+    header->compression = 0;
+    header->plt_num_pages = 0;
+    header->plt_offset = 0;
+    bool written = fwrite(header, pager.page_size, 1, file) == 1;
+    free(header);
+
+    uint32_t page_num = 1;
+    while (written && page_num < pager.num_pages) {
+        uint32_t count = 1;
+        if (pager.in_memory) {
+            // the rest of the chunk in one write
+            count = MEMORY_CHUNK_PAGES - page_num % MEMORY_CHUNK_PAGES;
+            if (count > pager.num_pages - page_num) {
+                count = pager.num_pages - page_num;
+            }
+        }
+        written = fwrite(get_page(page_num), pager.page_size, count, file) ==
+                  count;
+        page_num += count;
+    }
+    return fclose(file) == 0 && written;
+}
+
+void snapshot_write(const char* path) {
+    memtable_merge_all();
+    size_t name_size = strlen(path) + 16;
+    char* name = malloc(name_size);
+    for (uint32_t i = 0; i < partitions.count; i++) {
+        partition_use(i);
+        if (i == 0) {
+            snprintf(name, name_size, "%s", path);
+        } else {
+            snprintf(name, name_size, "%s.%u", path, i);
+        }
+        if (!snapshot_write_partition(name)) {
+            output_message("Unable to write snapshot '%s'.\n", name);
+            break;
+        }
+    }
+    free(name);
+}
+
+/*
+ *.export FILE: the rows in order of a as a binary stream, a header and then
+ *blocks of a row count, a CRC-32 of the rows and the rows as they are kept
+ *in the leaves, in the byte order of the machine; a block of no rows ends
+ *the stream
+ *the engine lock is taken per block, the next block continues after the
+ *last key of the previous one, so the background threads and statements
+ *only wait for one block: rows written during an export may or may not be
+ *in it
+ *.import FILE: every block is checked before any row is added, rows that
+ *sort after the last key of their partition are appended to its rightmost
+ *leaf, the others are inserted like `insert`
+ */
+#define EXPORT_MAGIC "MYJQLROW"
+#define EXPORT_VERSION 1
+// a block grows past this to keep all rows of its last key
+#define EXPORT_BLOCK_ROWS 4096
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t row_size;
+} export_header;
+typedef struct {
+    uint32_t num_rows;
+    uint32_t checksum;
+} export_block;
+
+uint32_t export_checksum(const void* data, size_t size) {
+    static uint32_t crc_table[256];
+    if (crc_table[1] == 0) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+            for (int bit = 0; bit < 8; bit++) {
+                c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            }
+            crc_table[i] = c;
+        }
+    }
+    const uint8_t* p = data;
+    uint32_t crc = 0xFFFFFFFFu;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// called with the engine lock held, which is released between blocks
+void table_export(const char* path) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        output_message("Unable to open file '%s'.\n", path);
+        return;
+    }
+    export_header header = {EXPORT_MAGIC, EXPORT_VERSION,
+                            sizeof(leaf_node_body)};
+    bool written = fwrite(&header, sizeof(header), 1, file) == 1;
+    uint32_t capacity = EXPORT_BLOCK_ROWS;
+    leaf_node_body* block_rows = malloc(capacity * sizeof(leaf_node_body));
+    uint32_t next_key = 0;
+    bool done = false;
+    while (written && !done) {
+        uint32_t count = 0;
+        RowIterator rows;
+        row_iterator_start_at(&rows, NULL, next_key);
+        leaf_node_body* value;
+        while ((value = row_iterator_next(&rows)) != NULL) {
+            // a block ends between two keys, the next starts after the last
+            if (count >= EXPORT_BLOCK_ROWS &&
+                value->a != block_rows[count - 1].a) {
+                break;
+            }
+            if (count == capacity) {
+                capacity *= 2;
+                block_rows =
+                    realloc(block_rows, capacity * sizeof(leaf_node_body));
+            }
+            block_rows[count++] = *value;
+        }
+        done = value == NULL;
+        if (!done) {
+            next_key = block_rows[count - 1].a + 1;
+        }
+        pthread_mutex_unlock(&engine_lock);
+        if (count > 0) {
+            export_block block = {
+                count,
+                export_checksum(block_rows, count * sizeof(leaf_node_body))};
+            written = fwrite(&block, sizeof(block), 1, file) == 1 &&
+                      fwrite(block_rows, sizeof(leaf_node_body), count,
+                             file) == count;
+        }
+        pthread_mutex_lock(&engine_lock);
+    }
+    export_block end = {0, 0};
+    written = written && fwrite(&end, sizeof(end), 1, file) == 1;
+    free(block_rows);
+    if (fclose(file) != 0 || !written) {
+        output_message("Unable to write file '%s'.\n", path);
+    }
+}
+
+/*
+ *read the next block of an export into `*rows`, growing them as needed
+ *`*remaining` is what is left of the file, a row count past it is damage
+ *return false if the block is damaged
+ */
+bool import_read_block(FILE* file, uint64_t* remaining, export_block* block,
+                       leaf_node_body** rows, uint32_t* capacity) {
+    if (*remaining < sizeof(export_block) ||
+        fread(block, sizeof(export_block), 1, file) != 1) {
+        return false;
+    }
+    *remaining -= sizeof(export_block);
+    if ((uint64_t)block->num_rows * sizeof(leaf_node_body) > *remaining) {
+        return false;
+    }
+    *remaining -= (uint64_t)block->num_rows * sizeof(leaf_node_body);
+    if (block->num_rows > *capacity) {
+        *capacity = block->num_rows;
+        *rows = realloc(*rows, *capacity * sizeof(leaf_node_body));
+    }
+    if (fread(*rows, sizeof(leaf_node_body), block->num_rows, file) !=
+            block->num_rows ||
+        export_checksum(*rows, block->num_rows * sizeof(leaf_node_body)) !=
+            block->checksum) {
+        return false;
+    }
+    for (uint32_t i = 0; i < block->num_rows; i++) {
+        if ((*rows)[i].a > INT32_MAX || (*rows)[i].b[COLUMN_B_SIZE] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ *the whole file is checked before the first row is added, a damaged
+ *export imports nothing and counts as an error
+ */
+void table_import(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        output_message("Unable to open file '%s'.\n", path);
+        throughput.errors++;
+        return;
+    }
+    export_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, EXPORT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != EXPORT_VERSION ||
+        header.row_size != sizeof(leaf_node_body)) {
+        output_message("File '%s' is not a myjql export.\n", path);
+        throughput.errors++;
+        fclose(file);
+        return;
+    }
+    struct stat file_stat;
+    fstat(fileno(file), &file_stat);
+    uint64_t body_size = file_stat.st_size - sizeof(header);
+    uint32_t capacity = EXPORT_BLOCK_ROWS;
+    leaf_node_body* block_rows = malloc(capacity * sizeof(leaf_node_body));
+    export_block block;
+    uint64_t remaining = body_size;
+    bool valid;
+    do {
+        valid = import_read_block(file, &remaining, &block, &block_rows,
+                                  &capacity);
+    } while (valid && block.num_rows > 0);
+    if (!valid) {
+        output_message("File '%s' is damaged, no rows imported.\n", path);
+        throughput.errors++;
+        free(block_rows);
+        fclose(file);
+        return;
+    }
+
+    fseek(file, sizeof(header), SEEK_SET);
+    remaining = body_size;
+    uint64_t imported = 0;
+    while (import_read_block(file, &remaining, &block, &block_rows,
+                             &capacity) &&
+           block.num_rows > 0) {
+        for (uint32_t i = 0; i < block.num_rows; i++) {
+            Row row;
+            deserialize_row(&block_rows[i], &row);
+            if (!b_tree_append_row(&row)) {
+                b_tree_insert_row(&row, CONFLICT_NONE);
+            }
+        }
+        imported += block.num_rows;
+    }
+    stats.rows_emitted[STATEMENT_INSERT] += imported;
+    free(block_rows);
+    fclose(file);
+}
+
+MetaCommandResult do_meta_command() {
+    if (strcmp(input_buffer.buffer, ".exit") == 0) {
+        // closing stops the merger, which needs the lock to finish
+        pthread_mutex_unlock(&engine_lock);
+        shell_close();
+        shell_finish();
+        exit(EXIT_SUCCESS);
+    } else if (strcmp(input_buffer.buffer, ".check") == 0) {
+        for (uint32_t i = 0; i < partitions.count; i++) {
+            partition_use(i);
+            if (partitions.count > 1) {
+                output_message("partition %u:\n", i);
+            }
+            check_tree();
+        }
+        return META_COMMAND_SUCCESS;
+    } else if (strcmp(input_buffer.buffer, ".stats") == 0) {
+        print_stats();
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer.buffer, ".snapshot ", 10) == 0 &&
+               input_buffer.buffer[10] != 0) {
+        snapshot_write(input_buffer.buffer + 10);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer.buffer, ".export ", 8) == 0 &&
+               input_buffer.buffer[8] != 0) {
+        table_export(input_buffer.buffer + 8);
+        return META_COMMAND_SUCCESS;
+    } else if (strncmp(input_buffer.buffer, ".import ", 8) == 0 &&
+               input_buffer.buffer[8] != 0) {
+        table_import(input_buffer.buffer + 8);
+        return META_COMMAND_SUCCESS;
+    } else {
+        return META_COMMAND_UNRECOGNIZED_COMMAND;
+    }
+}
+
+// parse a decimal column value, no copy and no locale
+PrepareResult parse_column_a(Token* token, uint32_t* value) {
+    const char* p = token->start;
+    const char* end = p + token->length;
+    if (*p == '-') return PREPARE_NEGATIVE_VALUE;
+    if (*p == '+') p++;
+    if (p == end) return PREPARE_SYNTAX_ERROR;
+
+    uint64_t x = 0;
+    for (; p < end; p++) {
+        uint32_t digit = *p - '0';
+        if (digit > 9) return PREPARE_SYNTAX_ERROR;
+        x = x * 10 + digit;
+        // printed as `%d`, keep it in range
+        if (x > INT32_MAX) return PREPARE_SYNTAX_ERROR;
+    }
+    *value = x;
+    return PREPARE_SUCCESS;
+}
+
+// column b is zero padded so cells compare with memcmp
+PrepareResult parse_column_b(Token* token, char* destination) {
+    if (token->length > COLUMN_B_SIZE) return PREPARE_STRING_TOO_LONG;
+    memset(destination, 0, COLUMN_B_SIZE + 1);
+    memcpy(destination, token->start, token->length);
+    return PREPARE_SUCCESS;
+}
+
+// `?` stands for a value bound later
+bool token_is_parameter(Token* token) {
+    return token->length == 1 && token->start[0] == '?';
+}
+
+// `insert [or ignore|or replace] a b`, `upsert a b`
+PrepareResult prepare_insert(const char* cursor, Statement* statement,
+                             ConflictMode conflict) {
+    statement->type = STATEMENT_INSERT;
+    statement->conflict = conflict;
+
+    Token a, b;
+    if (!next_token(&cursor, &a)) return PREPARE_SYNTAX_ERROR;
+    if (conflict == CONFLICT_NONE && token_equals(&a, "or")) {
+        Token action;
+        if (!next_token(&cursor, &action)) return PREPARE_SYNTAX_ERROR;
+        if (token_equals(&action, "ignore")) {
+            statement->conflict = CONFLICT_IGNORE;
+        } else if (token_equals(&action, "replace")) {
+            statement->conflict = CONFLICT_REPLACE;
+        } else {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        if (!next_token(&cursor, &a)) return PREPARE_SYNTAX_ERROR;
+    }
+    if (!next_token(&cursor, &b)) return PREPARE_SYNTAX_ERROR;
+
+    if (token_is_parameter(&a)) {
+        statement->params |= PARAM_A;
+    } else {
+        PrepareResult result = parse_column_a(&a, &statement->row.a);
+        if (result != PREPARE_SUCCESS) return result;
+    }
+    if (token_is_parameter(&b)) {
+        statement->params |= PARAM_B;
+        return PREPARE_SUCCESS;
+    }
+    return parse_column_b(&b, statement->row.b);
+}
+
+PrepareResult prepare_condition(const char* cursor, Statement* statement) {
+    statement->flag = 0;
+
+    Token b, c;
+    if (!next_token(&cursor, &b)) return PREPARE_SUCCESS;
+    if (next_token(&cursor, &c)) return PREPARE_SYNTAX_ERROR;
+
+    statement->flag = 1;
+    if (token_is_parameter(&b)) {
+        statement->params |= PARAM_B;
+        return PREPARE_SUCCESS;
+    }
+    PrepareResult result = parse_column_b(&b, statement->row.b);
+    if (result != PREPARE_SUCCESS) return result;
+
+    return PREPARE_SUCCESS;
+}
+
+// `[b] [order by b [limit n]]` after `select`, a b of `order` is only
+// taken for the clause when `by` follows
+PrepareResult prepare_select_rows(const char* cursor, Statement* statement) {
+    const char* clause = cursor;
+    Token word, by;
+    if (next_token(&clause, &word)) {
+        const char* after = clause;
+        if (token_equals(&word, "order") && next_token(&after, &by) &&
+            token_equals(&by, "by")) {
+            clause = cursor;
+        }
+    }
+    const char* condition_end = clause;
+    if (!next_token(&clause, &word)) {
+        return prepare_condition(cursor, statement);
+    }
+
+    Token column, limit_word, limit, extra;
+    if (!token_equals(&word, "order") || !next_token(&clause, &by) ||
+        !token_equals(&by, "by") || !next_token(&clause, &column) ||
+        !token_equals(&column, "b")) {
+        return PREPARE_SYNTAX_ERROR;
+    }
+    statement->order_by_b = true;
+    if (next_token(&clause, &limit_word)) {
+        if (!token_equals(&limit_word, "limit") ||
+            !next_token(&clause, &limit) || next_token(&clause, &extra)) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        PrepareResult result = parse_column_a(&limit, &statement->limit);
+        if (result != PREPARE_SUCCESS) return result;
+    }
+
+    // the condition is the one token before the clause, if any
+    Token b;
+    const char* condition = cursor;
+    statement->flag = 0;
+    if (condition != condition_end && next_token(&condition, &b)) {
+        statement->flag = 1;
+        if (token_is_parameter(&b)) {
+            statement->params |= PARAM_B;
+            return PREPARE_SUCCESS;
+        }
+        return parse_column_b(&b, statement->row.b);
+    }
+    return PREPARE_SUCCESS;
+}
+
+// `select [count(*)|min(a)|max(a)] [b]`, `select count(*) group by b`,
+// `select [b] order by b [limit n]`
+PrepareResult prepare_select(const char* cursor, Statement* statement) {
+    statement->type = STATEMENT_SELECT;
+    statement->aggregate = AGGREGATE_NONE;
+
+    const char* rest = cursor;
+    Token word;
+    if (!next_token(&rest, &word)) {
+        return prepare_condition(cursor, statement);
+    }
+    if (token_equals(&word, "count(*)")) {
+        statement->aggregate = AGGREGATE_COUNT;
+    } else if (token_equals(&word, "min(a)")) {
+        statement->aggregate = AGGREGATE_MIN;
+    } else if (token_equals(&word, "max(a)")) {
+        statement->aggregate = AGGREGATE_MAX;
+    } else {
+        return prepare_select_rows(cursor, statement);
+    }
+
+    Token group_word, by, column, extra;
+    const char* after = rest;
+    if (statement->aggregate == AGGREGATE_COUNT &&
+        next_token(&after, &group_word) && token_equals(&group_word, "group")) {
+        if (!next_token(&after, &by) || !token_equals(&by, "by") ||
+            !next_token(&after, &column) || !token_equals(&column, "b") ||
+            next_token(&after, &extra)) {
+            return PREPARE_SYNTAX_ERROR;
+        }
+        statement->aggregate = AGGREGATE_GROUP_COUNT;
+        statement->flag = 0;
+        return PREPARE_SUCCESS;
+    }
+    return prepare_condition(rest, statement);
+}
+
+PrepareResult prepare_delete(const char* cursor, Statement* statement) {
+    statement->type = STATEMENT_DELETE;
+    PrepareResult result = prepare_condition(cursor, statement);
+    if (result == PREPARE_SUCCESS && statement->flag == 0)
+        return PREPARE_SYNTAX_ERROR;
+    return result;
+}
+
+// parse `line` into `statement`, does not touch any other state so it can
+// run ahead of execution
+PrepareResult prepare_statement(const char* line, Statement* statement) {
+    const char* cursor = line;
+    Token keyword;
+    statement->explain = EXPLAIN_NONE;
+    statement->aggregate = AGGREGATE_NONE;
+    statement->order_by_b = false;
+    statement->limit = NO_LIMIT;
+    statement->params = 0;
+    if (!next_token(&cursor, &keyword)) {
+        return PREPARE_EMPTY_STATEMENT;
+    }
+    if (token_equals(&keyword, "explain")) {
+        statement->explain = EXPLAIN_PLAN;
+        if (!next_token(&cursor, &keyword)) return PREPARE_SYNTAX_ERROR;
+        if (token_equals(&keyword, "analyze")) {
+            statement->explain = EXPLAIN_ANALYZE;
+            if (!next_token(&cursor, &keyword)) return PREPARE_SYNTAX_ERROR;
+        }
+    }
+    if (token_equals(&keyword, "insert")) {
+        return prepare_insert(cursor, statement, CONFLICT_NONE);
+    } else if (token_equals(&keyword, "upsert")) {
+        return prepare_insert(cursor, statement, CONFLICT_REPLACE);
+    } else if (token_equals(&keyword, "select")) {
+        return prepare_select(cursor, statement);
+    } else if (token_equals(&keyword, "delete")) {
+        return prepare_delete(cursor, statement);
+    }
+    return PREPARE_UNRECOGNIZED_STATEMENT;
+}
+
+// the shell has nothing to bind parameters with
+PrepareResult prepare_shell_statement(const char* line, Statement* statement) {
+    PrepareResult result = prepare_statement(line, statement);
+    if (result == PREPARE_SUCCESS && statement->params != 0) {
+        return PREPARE_UNBOUND_PARAMETER;
+    }
+    return result;
+}
+
+ExecuteResult execute_select() {
+    if (!output.discard_rows) {
+        output_decoration("\n");
+    }
+    switch (statement.aggregate) {
+        case AGGREGATE_NONE:
+            if (statement.order_by_b) {
+                b_tree_sort();
+            } else if (statement.flag == 0) {
+                b_tree_traverse();
+            } else {
+                b_tree_search();
+            }
+            break;
+        case AGGREGATE_GROUP_COUNT:
+            b_tree_group_count();
+            break;
+        default:
+            b_tree_aggregate();
+            break;
+    }
+    return EXECUTE_SUCCESS;
+}
+
+ExecuteResult execute_statement() {
+    switch (statement.type) {
+        case STATEMENT_INSERT:
+            b_tree_insert();
+            return EXECUTE_SUCCESS;
+        case STATEMENT_SELECT:
+            return execute_select();
+        case STATEMENT_DELETE:
+            b_tree_delete();
+            return EXECUTE_SUCCESS;
+    }
+    // the parser only hands out the types above
+    fprintf(stderr, "Unknown statement type %d.\n", statement.type);
+    exit(EXIT_FAILURE);
+}
+
+void print_select_plan(uint32_t height) {
+    static const char* names[] = {"select", "select count(*)",
+                                  "select min(a)", "select max(a)",
+                                  "select count(*) group by b"};
+    const char* name = names[statement.aggregate];
+    if (statement.aggregate == AGGREGATE_GROUP_COUNT) {
+        output_message("%s: scan of the leaf chain, hash aggregation in "
+                       "%zu bytes\n",
+                       name, group.memory_limit);
+    } else if (statement.flag == 1) {
+        output_message("%s: scan of the leaf chain%s, filter b = '%s' with "
+                       "b summaries\n",
+                       name,
+                       statement.aggregate == AGGREGATE_MIN
+                           ? " to the first match"
+                           : "",
+                       statement.row.b);
+    } else if (statement.aggregate == AGGREGATE_COUNT) {
+        output_message("%s: cell counts of the leaf chain\n", name);
+    } else if (statement.aggregate != AGGREGATE_NONE) {
+        output_message("%s: %s leaf, %u levels\n", name,
+                       statement.aggregate == AGGREGATE_MIN ? "leftmost"
+                                                            : "rightmost",
+                       height);
+    } else {
+        output_message("%s: scan of the leaf chain\n", name);
+    }
+    if (!statement.order_by_b) {
+        return;
+    }
+    size_t capacity = sort.memory_limit / (2 * sizeof(leaf_node_body));
+    if (statement.limit <= capacity) {
+        output_message("order by b: top %u rows in a heap\n", statement.limit);
+    } else {
+        output_message("order by b: radix sort in %zu bytes, larger inputs "
+                       "are merged from sorted runs in temporary files\n",
+                       sort.memory_limit);
+    }
+}
+
+// access path of the global statement, there is no index on b
+void print_plan() {
+    if (statement.type == STATEMENT_INSERT) {
+        partition_use(partition_of(statement.row.a));
+    }
+    uint32_t height = node_level(table.root_page_num) + 1;
+    switch (statement.type) {
+        case STATEMENT_INSERT: {
+            static const char* conflicts[] = {"", ", replace if present",
+                                              ", ignore if present"};
+            output_message("insert: index seek on a = %u, %u levels%s\n",
+                           statement.row.a, height,
+                           conflicts[statement.conflict]);
+            break;
+        }
+        case STATEMENT_SELECT:
+            print_select_plan(height);
+            break;
+        case STATEMENT_DELETE:
+            output_message("delete: scan of the leaf chain, filter b = '%s' "
+                           "with b summaries\n",
+                           statement.row.b);
+            break;
+    }
+    if (memtable.capacity > 0 && statement.type == STATEMENT_INSERT) {
+        output_message("memtable: buffered, %u of %u rows in use\n",
+                       memtable.active->size - 1, memtable.capacity);
+    } else if (memtable.capacity > 0) {
+        output_message("memtable: %u rows scanned with the tree\n",
+                       memtable.active->size - 1 +
+                           (memtable.immutable ? memtable.immutable->size - 1
+                                               : 0));
+    }
+    if (partitions.count == 1) {
+        return;
+    }
+    const char* scheme =
+        partitions.scheme == MYJQL_PARTITION_RANGE ? "range" : "hash";
+    if (statement.type == STATEMENT_INSERT) {
+        output_message("partitions: %u by %s of a, routed to partition %u\n",
+                       partitions.count, scheme, partitions.current);
+    } else {
+        output_message("partitions: %u by %s of a, each one in turn%s\n",
+                       partitions.count, scheme,
+                       statement.type == STATEMENT_SELECT &&
+                               statement.aggregate == AGGREGATE_NONE &&
+                               partitions.scheme == MYJQL_PARTITION_HASH
+                           ? ", rows merged on a"
+                           : "");
+    }
+}
+
+// explain prints the plan, explain analyze also runs the statement without
+// printing its rows and reports what it cost
+void run_explain() {
+    print_plan();
+    if (statement.explain == EXPLAIN_PLAN) {
+        return;
+    }
+    StatementType type = statement.type;
+    uint64_t examined = stats.rows_scanned[type];
+    uint64_t emitted = stats.rows_emitted[type];
+    uint64_t lookups = pager.hits + pager.misses;
+    uint64_t misses = pager.misses;
+    uint64_t pages_read = pager.pages_read;
+    stats.touched_capacity = pager.num_pages + 64;
+    stats.touched = calloc(stats.touched_capacity, 1);
+    stats.pages_touched = 0;
+    output.discard_rows = true;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    execute_statement();
+    double seconds = elapsed_seconds(&start);
+
+    output.discard_rows = false;
+    free(stats.touched);
+    stats.touched = NULL;
+    stats.touched_capacity = 0;
+    output_message("actual: %llu rows examined, %llu emitted, %.3f ms\n",
+                   (unsigned long long)(stats.rows_scanned[type] - examined),
+                   (unsigned long long)(stats.rows_emitted[type] - emitted),
+                   seconds * 1e3);
+    output_message("pages: %llu touched, %llu lookups, %llu misses, %llu read\n",
+                   (unsigned long long)stats.pages_touched,
+                   (unsigned long long)(pager.hits + pager.misses - lookups),
+                   (unsigned long long)(pager.misses - misses),
+                   (unsigned long long)(pager.pages_read - pages_read));
+}
+
+// execute the global statement, timed when --throughput is on
+void run_statement() {
+    pthread_mutex_lock(&engine_lock);
+    if (statement.explain != EXPLAIN_NONE) {
+        run_explain();
+        pthread_mutex_unlock(&engine_lock);
+        return;
+    }
+    struct timespec start;
+    if (throughput.enabled) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+    uint64_t cycles = read_cycles();
+    throughput.statements++;
+    switch (execute_statement()) {
+        case EXECUTE_SUCCESS:
+            output_decoration("\nExecuted.\n\n");
+            break;
+    }
+    stats.count[statement.type]++;
+    stats.cycles[statement.type] += read_cycles() - cycles;
+    if (throughput.enabled) {
+        double seconds = elapsed_seconds(&start);
+        throughput.count[statement.type]++;
+        throughput.seconds[statement.type] += seconds;
+        throughput.latency[statement.type][latency_bucket(seconds * 1e9)]++;
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
+
+// return true if `result` is an error worth reporting
+bool print_prepare_error(PrepareResult result, const char* line) {
+    switch (result) {
+        case PREPARE_SUCCESS:
+        case PREPARE_EMPTY_STATEMENT:
+            return false;
+        case PREPARE_NEGATIVE_VALUE:
+            output_message("Column `a` must be positive.\n");
+            break;
+        case PREPARE_STRING_TOO_LONG:
+            output_message("String for column `b` is too long.\n");
+            break;
+        case PREPARE_SYNTAX_ERROR:
+            output_message("Syntax error. Could not parse statement.\n");
+            break;
+        case PREPARE_UNRECOGNIZED_STATEMENT:
+            output_message("Unrecognized keyword at start of '%s'.\n", line);
+            break;
+        case PREPARE_UNBOUND_PARAMETER:
+            output_message("Parameters can only be bound through libmyjql.\n");
+            break;
+    }
+    throughput.errors++;
+    return true;
+}
+
+void run_meta_command() {
+    pthread_mutex_lock(&engine_lock);
+    switch (do_meta_command()) {
+        case META_COMMAND_SUCCESS:
+            break;
+        case META_COMMAND_UNRECOGNIZED_COMMAND:
+            output_message("Unrecognized command '%s'.\n",
+                           input_buffer.buffer);
+            break;
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
+
+/*
+ *libmyjql: statements are prepared with the shell's parser and run on the
+ *same engine functions, selects are stepped through a row iterator instead
+ *of being printed
+ *the engine lives in globals, so there is one database handle per process
+ */
+struct myjql {
+    char errmsg[64];
+    uint64_t changes;
+};
+struct myjql_stmt {
+    myjql* db;
+    Statement statement;
+    uint8_t bound;  // PARAM_A | PARAM_B
+    bool started;
+    bool done;
+    RowIterator rows;
+    leaf_node_body value;  // result of an aggregate
+    const leaf_node_body* row;
+};
+myjql* library_db;
+
+int library_error(myjql* db, int code, const char* message) {
+    snprintf(db->errmsg, sizeof(db->errmsg), "%s", message);
+    return code;
+}
+
+int myjql_open(const char* filename, const myjql_options* options,
+               myjql** db) {
+    myjql_options defaults = {DEFAULT_PAGE_SIZE, 0, DEFAULT_CACHE_PAGES, 1,
+                              MYJQL_PARTITION_HASH, 0, 0, 0, 0, NULL};
+    if (options != NULL) {
+        defaults.compression = options->compression;
+        defaults.partition_by = options->partition_by;
+        defaults.memtable_rows = options->memtable_rows;
+        defaults.dirty_target = options->dirty_target;
+        defaults.checkpoint_ms = options->checkpoint_ms;
+        defaults.direct_io = options->direct_io;
+        defaults.snapshot = options->snapshot;
+        if (options->partitions != 0) defaults.partitions = options->partitions;
+        if (options->page_size != 0) defaults.page_size = options->page_size;
+        if (options->cache_pages != 0) {
+            defaults.cache_pages = options->cache_pages;
+        }
+    }
+    *db = NULL;
+    if (library_db != NULL) {
+        return MYJQL_BUSY;
+    }
+    if (!page_size_valid(defaults.page_size) || defaults.compression < 0 ||
+        defaults.compression > LZ_MAX_LEVEL ||
+        defaults.cache_pages < MIN_CACHE_PAGES ||
+        defaults.partitions > MAX_PARTITIONS ||
+        defaults.partition_by > MYJQL_PARTITION_RANGE ||
+        defaults.memtable_rows > MEMTABLE_MAX_ROWS ||
+        defaults.dirty_target > 100) {
+        return MYJQL_RANGE;
+    }
+    if (defaults.snapshot != NULL &&
+        strcmp(filename, MEMORY_DATABASE) != 0) {
+        return MYJQL_MISUSE;
+    }
+    pager.num_frames = defaults.cache_pages;
+    pager.direct_io = defaults.direct_io;
+    pager.snapshot = defaults.snapshot;
+    partitions_open(filename, defaults.page_size, defaults.compression,
+                    defaults.partitions, defaults.partition_by);
+    memtable_open(defaults.memtable_rows);
+    flusher_open(defaults.dirty_target, defaults.checkpoint_ms);
+    library_db = calloc(1, sizeof(myjql));
+    *db = library_db;
+    return MYJQL_OK;
+}
+
+int myjql_close(myjql* db) {
+    if (db == NULL || db != library_db) {
+        return MYJQL_MISUSE;
+    }
+    flusher_close();
+    memtable_close();
+    partitions_close();
+    free(db);
+    library_db = NULL;
+    return MYJQL_OK;
+}
+
+const char* myjql_errmsg(myjql* db) { return db->errmsg; }
+
+uint64_t myjql_changes(myjql* db) { return db->changes; }
+
+int myjql_prepare(myjql* db, const char* sql, myjql_stmt** stmt) {
+    *stmt = NULL;
+    Statement parsed;
+    switch (prepare_statement(sql, &parsed)) {
+        case PREPARE_SUCCESS:
+            break;
+        case PREPARE_NEGATIVE_VALUE:
+        case PREPARE_STRING_TOO_LONG:
+            return library_error(db, MYJQL_RANGE, "value out of range");
+        case PREPARE_EMPTY_STATEMENT:
+            return library_error(db, MYJQL_ERROR, "empty statement");
+        default:
+            return library_error(db, MYJQL_ERROR, "syntax error");
+    }
+    if (parsed.explain != EXPLAIN_NONE ||
+        parsed.aggregate == AGGREGATE_GROUP_COUNT || parsed.order_by_b) {
+        return library_error(db, MYJQL_ERROR, "only available in the shell");
+    }
+    *stmt = calloc(1, sizeof(myjql_stmt));
+    (*stmt)->db = db;
+    (*stmt)->statement = parsed;
+    return MYJQL_OK;
+}
+
+int myjql_bind_a(myjql_stmt* stmt, uint32_t a) {
+    if (!(stmt->statement.params & PARAM_A)) {
+        return library_error(stmt->db, MYJQL_RANGE, "no parameter for a");
+    }
+    if (a > INT32_MAX) {
+        return library_error(stmt->db, MYJQL_RANGE, "value out of range");
+    }
+    stmt->statement.row.a = a;
+    stmt->bound |= PARAM_A;
+    return MYJQL_OK;
+}
+
+int myjql_bind_b(myjql_stmt* stmt, const char* b, size_t length) {
+    if (!(stmt->statement.params & PARAM_B)) {
+        return library_error(stmt->db, MYJQL_RANGE, "no parameter for b");
+    }
+    if (length > COLUMN_B_SIZE) {
+        return library_error(stmt->db, MYJQL_RANGE, "value out of range");
+    }
+    // zero padded, cells are compared with memcmp
+    memset(stmt->statement.row.b, 0, COLUMN_B_SIZE + 1);
+    memcpy(stmt->statement.row.b, b, length);
+    stmt->bound |= PARAM_B;
+    return MYJQL_OK;
+}
+
+// a select between its first and last row keeps the memtables from being
+// merged under it
+void library_unpin(myjql_stmt* stmt) {
+    if (stmt->started && !stmt->done &&
+        stmt->statement.aggregate == AGGREGATE_NONE) {
+        memtable.pinned--;
+        pthread_cond_broadcast(&memtable.changed);
+    }
+}
+
+int library_step(myjql_stmt* stmt) {
+    if (stmt->bound != stmt->statement.params) {
+        return library_error(stmt->db, MYJQL_MISUSE, "parameter not bound");
+    }
+    stmt->row = NULL;
+    if (stmt->done) {
+        return MYJQL_DONE;
+    }
+    Statement* prepared = &stmt->statement;
+    // a select between steps holds positions in the leaves and memtables
+    // that a write could split, rotate or merge away
+    if (prepared->type != STATEMENT_SELECT && memtable.pinned > 0) {
+        return library_error(stmt->db, MYJQL_BUSY,
+                             "a select is being stepped");
+    }
+    if (prepared->type != STATEMENT_SELECT) {
+        uint64_t emitted = stats.rows_emitted[prepared->type];
+        statement = *prepared;
+        execute_statement();
+        stmt->db->changes = stats.rows_emitted[prepared->type] - emitted;
+        stmt->done = true;
+        return MYJQL_DONE;
+    }
+    if (!stmt->started) {
+        stmt->started = true;
+        if (prepared->aggregate != AGGREGATE_NONE) {
+            stmt->done = true;
+            statement = *prepared;
+            memset(&stmt->value, 0, sizeof(stmt->value));
+            if (!aggregate_value(&stmt->value.a)) {
+                return MYJQL_DONE;
+            }
+            stmt->row = &stmt->value;
+            return MYJQL_ROW;
+        }
+        memtable.pinned++;
+        row_iterator_start(&stmt->rows, prepared->flag ? prepared->row.b : NULL);
+    }
+    stmt->row = row_iterator_next(&stmt->rows);
+    if (stmt->row == NULL) {
+        library_unpin(stmt);
+        stmt->done = true;
+        stats.rows_scanned[STATEMENT_SELECT] += stmt->rows.scanned;
+        return MYJQL_DONE;
+    }
+    return MYJQL_ROW;
+}
+
+int myjql_step(myjql_stmt* stmt) {
+    pthread_mutex_lock(&engine_lock);
+    int result = library_step(stmt);
+    pthread_mutex_unlock(&engine_lock);
+    return result;
+}
+
+const leaf_node_body* myjql_row(myjql_stmt* stmt) { return stmt->row; }
+
+int myjql_reset(myjql_stmt* stmt) {
+    pthread_mutex_lock(&engine_lock);
+    library_unpin(stmt);
+    pthread_mutex_unlock(&engine_lock);
+    stmt->started = false;
+    stmt->done = false;
+    stmt->row = NULL;
+    return MYJQL_OK;
+}
+
+void myjql_finalize(myjql_stmt* stmt) {
+    pthread_mutex_lock(&engine_lock);
+    library_unpin(stmt);
+    pthread_mutex_unlock(&engine_lock);
+    free(stmt);
+}
+
+/*
+ *batch mode: a parser thread prepares the statements of a script ahead of
+ *execution and hands them over in chunks through a small ring
+ */
+#define BATCH_CHUNK_SIZE 1024
+#define BATCH_RING_SIZE 8
+typedef enum { BATCH_STATEMENT, BATCH_META, BATCH_ERROR } BatchItemType;
+typedef struct {
+    BatchItemType type;
+    PrepareResult result;
+    Statement statement;
+    char* line;  // terminated in place, for meta commands and messages
+    bool copied;  // the last line, freed once run
+} BatchItem;
+typedef struct {
+    BatchItem items[BATCH_CHUNK_SIZE];
+    uint32_t count;
+} BatchChunk;
+struct {
+    char* data;
+    size_t length;
+    BatchChunk ring[BATCH_RING_SIZE];
+    uint32_t produced;
+    uint32_t consumed;
+    bool done;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} batch;
+
+// next line of the script, NULL at the end; a last line without '\n' is a
+// copy, see batch_line_copied
+char* batch_next_line(char** cursor) {
+    char* end = batch.data + batch.length;
+    char* line = *cursor;
+    if (line >= end) {
+        return NULL;
+    }
+    char* newline = memchr(line, '\n', end - line);
+    if (newline != NULL) {
+        *newline = 0;
+        *cursor = newline + 1;
+        return line;
+    }
+    // no room for the '\0' after the last byte of the mapping
+    *cursor = end;
+    return strndup(line, end - line);
+}
+
+bool batch_line_copied(const char* line) {
+    return line < batch.data || line >= batch.data + batch.length;
+}
+
+void* batch_parse(void* arg) {
+    char* cursor = batch.data;
+    char* line = batch_next_line(&cursor);
+    while (line != NULL) {
+        pthread_mutex_lock(&batch.lock);
+        while (batch.produced - batch.consumed == BATCH_RING_SIZE) {
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        BatchChunk* chunk = &batch.ring[batch.produced % BATCH_RING_SIZE];
+        chunk->count = 0;
+        for (; line != NULL && chunk->count < BATCH_CHUNK_SIZE;
+             line = batch_next_line(&cursor)) {
+            BatchItem* item = &chunk->items[chunk->count];
+            item->line = line;
+            item->copied = batch_line_copied(line);
+            if (line[0] == '.') {
+                item->type = BATCH_META;
+            } else {
+                item->result = prepare_shell_statement(line, &item->statement);
+                if (item->result == PREPARE_EMPTY_STATEMENT) {
+                    if (item->copied) {
+                        free(line);
+                    }
+                    continue;
+                }
+                item->type = item->result == PREPARE_SUCCESS ? BATCH_STATEMENT
+                                                             : BATCH_ERROR;
+            }
+            chunk->count++;
+        }
+        throughput.parse_seconds += elapsed_seconds(&start);
+
+        pthread_mutex_lock(&batch.lock);
+        batch.produced++;
+        pthread_cond_broadcast(&batch.changed);
+        pthread_mutex_unlock(&batch.lock);
+    }
+    pthread_mutex_lock(&batch.lock);
+    batch.done = true;
+    pthread_cond_broadcast(&batch.changed);
+    pthread_mutex_unlock(&batch.lock);
+    return NULL;
+}
+
+void run_batch_item(BatchItem* item) {
+    switch (item->type) {
+        case BATCH_STATEMENT:
+            statement = item->statement;
+            run_statement();
+            break;
+        case BATCH_META:
+            input_buffer.buffer = item->line;
+            input_buffer.length = strlen(item->line);
+            run_meta_command();
+            break;
+        case BATCH_ERROR:
+            print_prepare_error(item->result, item->line);
+            break;
+    }
+    if (item->copied) {
+        free(item->line);
+    }
+}
+
+// execute a script end to end, lines have no length limit
+void run_batch(const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "Unable to open batch file '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    batch.length = st.st_size;
+    if (batch.length > 0) {
+        batch.data = mmap(NULL, batch.length, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE, fd, 0);
+        if (batch.data == MAP_FAILED) {
+            fprintf(stderr, "Unable to map batch file '%s'.\n", path);
+            exit(EXIT_FAILURE);
+        }
+        madvise(batch.data, batch.length, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    pthread_t parser;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+    pthread_create(&parser, NULL, batch_parse, NULL);
+
+    while (1) {
+        pthread_mutex_lock(&batch.lock);
+        while (batch.consumed == batch.produced && !batch.done) {
+            pthread_cond_wait(&batch.changed, &batch.lock);
+        }
+        if (batch.consumed == batch.produced) {
+            pthread_mutex_unlock(&batch.lock);
+            break;
+        }
+        pthread_mutex_unlock(&batch.lock);
+
+        BatchChunk* chunk = &batch.ring[batch.consumed % BATCH_RING_SIZE];
+        for (uint32_t i = 0; i < chunk->count; i++) {
+            run_batch_item(&chunk->items[i]);
+        }
+
+        pthread_mutex_lock(&batch.lock);
+        batch.consumed++;
+        pthread_cond_broadcast(&batch.changed);
+        pthread_mutex_unlock(&batch.lock);
+    }
+    pthread_join(parser, NULL);
+}
+
+void run_repl() {
+    while (1) {
+        print_prompt();
+        switch (read_input()) {
+            case INPUT_SUCCESS:
+                break;
+            case INPUT_TOO_LONG:
+                output_message("Input is too long.\n");
+                continue;
+            case INPUT_EOF:
+                return;
+        }
+
+        if (input_buffer.buffer[0] == '.') {
+            run_meta_command();
+            continue;
+        }
+
+        PrepareResult result =
+            prepare_shell_statement(input_buffer.buffer, &statement);
+        if (result != PREPARE_SUCCESS) {
+            print_prepare_error(result, input_buffer.buffer);
+            continue;
+        }
+        run_statement();
+    }
+}
+
+/*
+ *server mode: `--serve PATH` shares one engine and buffer pool between
+ *local processes over a Unix domain socket
+ *requests and responses are 20 byte frames in native byte order; a client
+ *may pipeline any number of requests, each is answered in order by its rows
+ *followed by a DONE frame, and the answers to everything read in one go are
+ *sent with one write
+ *a select is answered in chunks of about SERVE_OUTPUT_LIMIT bytes, each
+ *under one hold of the engine lock; a chunk ends between two keys and the
+ *next continues after the last key sent, like .export, so rows written by
+ *other connections meanwhile may or may not be in the answer
+ */
+#define SERVE_MAX_EVENTS 64
+#define SERVE_INPUT_SIZE (64 << 10)
+// a connection is not read while this much of its output is unsent
+#define SERVE_OUTPUT_LIMIT (1 << 20)
+
+typedef enum {
+    SERVE_INSERT = 1,
+    SERVE_UPSERT,
+    SERVE_INSERT_IGNORE,
+    SERVE_SELECT,
+    SERVE_DELETE,  // needs SERVE_FILTER_B
+    SERVE_COUNT,
+    SERVE_MIN,
+    SERVE_MAX
+} ServeOp;
+#define SERVE_FILTER_B 1  // only rows whose b equals the request's b
+
+typedef enum { SERVE_ROW = 1, SERVE_DONE, SERVE_ERROR } ServeStatus;
+typedef enum { SERVE_BAD_REQUEST = 1, SERVE_BAD_VALUE } ServeError;
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t a;
+    char b[COLUMN_B_SIZE + 1];  // zero terminated unless all 12 bytes used
+} serve_request;
+typedef struct {
+    uint32_t status;
+    uint32_t a;  // DONE: rows returned, inserted or deleted, ERROR: reason
+    char b[COLUMN_B_SIZE + 1];
+} serve_response;
+
+typedef struct {
+    int fd;
+    bool eof;  // the client shut down its side, answer and close
+    char input[SERVE_INPUT_SIZE];
+    size_t input_length;
+    char* output;
+    size_t output_length;
+    size_t output_sent;
+    size_t output_capacity;
+    uint32_t events;  // registered with epoll
+    // a select whose rows are still being sent, it holds back the requests
+    // after it
+    bool selecting;
+    serve_request select;
+    uint32_t select_next_key;
+    uint32_t select_count;
+} Connection;
+
+struct {
+    int epoll_fd;
+    int listen_fd;
+    volatile sig_atomic_t stopping;
+    uint64_t connections;
+} server;
+
+void serve_respond(Connection* connection, uint32_t status, uint32_t a,
+                   const char* b) {
+    if (connection->output_length + sizeof(serve_response) >
+        connection->output_capacity) {
+        connection->output_capacity = connection->output_capacity * 2 + 4096;
+        connection->output =
+            realloc(connection->output, connection->output_capacity);
+    }
+    serve_response* response =
+        (serve_response*)(connection->output + connection->output_length);
+    response->status = status;
+    response->a = a;
+    if (b != NULL) {
+        memcpy(response->b, b, B_SIZE);
+    } else {
+        memset(response->b, 0, B_SIZE);
+    }
+    connection->output_length += sizeof(serve_response);
+}
+
+// b of a request into `statement.row.b`, zero padded like a parsed b
+bool serve_column_b(const serve_request* request) {
+    size_t length = strnlen(request->b, COLUMN_B_SIZE + 1);
+    if (length > COLUMN_B_SIZE) {
+        return false;
+    }
+    memset(statement.row.b, 0, COLUMN_B_SIZE + 1);
+    memcpy(statement.row.b, request->b, length);
+    return true;
+}
+
+// the next rows of the select of `connection`, then its DONE frame once
+// they are all out
+void serve_select_chunk(Connection* connection) {
+    bool filtered = connection->select.flags & SERVE_FILTER_B;
+    char b[COLUMN_B_SIZE + 1] = {0};
+    memcpy(b, connection->select.b,
+           strnlen(connection->select.b, COLUMN_B_SIZE));
+    size_t limit = connection->output_length + SERVE_OUTPUT_LIMIT;
+
+    pthread_mutex_lock(&engine_lock);
+    RowIterator rows;
+    row_iterator_start_at(&rows, filtered ? b : NULL,
+                          connection->select_next_key);
+    leaf_node_body* value;
+    uint32_t last_key = 0;
+    uint32_t count = 0;
+    while ((value = row_iterator_next(&rows)) != NULL) {
+        if (count > 0 && connection->output_length >= limit &&
+            value->a != last_key) {
+            break;
+        }
+        last_key = value->a;
+        // like the shell's select, rows without b are not shown
+        if (!filtered && value->b[0] == 0) {
+            continue;
+        }
+        serve_respond(connection, SERVE_ROW, value->a, value->b);
+        count++;
+    }
+    stats.request_rows_scanned[STATEMENT_SELECT] += rows.scanned;
+    stats.rows_emitted[STATEMENT_SELECT] += count;
+    pthread_mutex_unlock(&engine_lock);
+
+    connection->select_count += count;
+    if (value == NULL) {
+        connection->selecting = false;
+        serve_respond(connection, SERVE_DONE, connection->select_count, NULL);
+    } else {
+        connection->select_next_key = last_key + 1;
+    }
+}
+
+// the b_tree_* operation behind one request, answered into `connection`
+void serve_execute(Connection* connection, const serve_request* request) {
+    static const ConflictMode conflicts[] = {CONFLICT_NONE, CONFLICT_REPLACE,
+                                             CONFLICT_IGNORE};
+    static const Aggregate aggregates[] = {AGGREGATE_COUNT, AGGREGATE_MIN,
+                                           AGGREGATE_MAX};
+    bool filtered = request->flags & SERVE_FILTER_B;
+    if (request->op < SERVE_INSERT || request->op > SERVE_MAX ||
+        (request->op == SERVE_DELETE && !filtered)) {
+        serve_respond(connection, SERVE_ERROR, SERVE_BAD_REQUEST, NULL);
+        return;
+    }
+    if (!serve_column_b(request) ||
+        (request->op <= SERVE_INSERT_IGNORE && request->a > INT32_MAX)) {
+        serve_respond(connection, SERVE_ERROR, SERVE_BAD_VALUE, NULL);
+        return;
+    }
+    statement.row.a = request->a;
+    statement.flag = filtered;
+    statement.explain = EXPLAIN_NONE;
+    statement.aggregate = AGGREGATE_NONE;
+    statement.conflict = CONFLICT_NONE;
+
+    pthread_mutex_lock(&engine_lock);
+    uint64_t scanned[3];
+    memcpy(scanned, stats.rows_scanned, sizeof(scanned));
+    uint32_t count = 0;
+    if (request->op <= SERVE_INSERT_IGNORE) {
+        statement.type = STATEMENT_INSERT;
+        statement.conflict = conflicts[request->op - SERVE_INSERT];
+        uint64_t emitted = stats.rows_emitted[STATEMENT_INSERT];
+        b_tree_insert();
+        count = stats.rows_emitted[STATEMENT_INSERT] - emitted;
+    } else if (request->op == SERVE_DELETE) {
+        statement.type = STATEMENT_DELETE;
+        uint64_t emitted = stats.rows_emitted[STATEMENT_DELETE];
+        b_tree_delete();
+        count = stats.rows_emitted[STATEMENT_DELETE] - emitted;
+    } else if (request->op == SERVE_SELECT) {
+        statement.type = STATEMENT_SELECT;
+        stats.requests[statement.type]++;
+        pthread_mutex_unlock(&engine_lock);
+        connection->selecting = true;
+        connection->select = *request;
+        connection->select_next_key = 0;
+        connection->select_count = 0;
+        serve_select_chunk(connection);
+        return;
+    } else {
+        statement.type = STATEMENT_SELECT;
+        statement.aggregate = aggregates[request->op - SERVE_COUNT];
+        uint32_t value;
+        if (aggregate_value(&value)) {
+            serve_respond(connection, SERVE_ROW, value, NULL);
+            stats.rows_emitted[STATEMENT_SELECT]++;
+            count = 1;
+        }
+    }
+    // the engine added its rows to the statement counters
+    stats.requests[statement.type]++;
+    stats.request_rows_scanned[statement.type] +=
+        stats.rows_scanned[statement.type] - scanned[statement.type];
+    stats.rows_scanned[statement.type] = scanned[statement.type];
+    pthread_mutex_unlock(&engine_lock);
+    serve_respond(connection, SERVE_DONE, count, NULL);
+}
+
+// answer the complete requests in the input, unless output is backed up
+void serve_process(Connection* connection) {
+    size_t offset = 0;
+    while (connection->output_length - connection->output_sent <
+           SERVE_OUTPUT_LIMIT) {
+        if (connection->selecting) {
+            serve_select_chunk(connection);
+            continue;
+        }
+        if (connection->input_length - offset < sizeof(serve_request)) {
+            break;
+        }
+        serve_request request;
+        memcpy(&request, connection->input + offset, sizeof(request));
+        serve_execute(connection, &request);
+        offset += sizeof(serve_request);
+    }
+    memmove(connection->input, connection->input + offset,
+            connection->input_length - offset);
+    connection->input_length -= offset;
+}
+
+// write what the socket takes, return false if the client is gone
+bool serve_send(Connection* connection) {
+    while (connection->output_sent < connection->output_length) {
+        ssize_t written =
+            send(connection->fd, connection->output + connection->output_sent,
+                 connection->output_length - connection->output_sent,
+                 MSG_NOSIGNAL);
+        if (written == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        connection->output_sent += written;
+    }
+    connection->output_length = 0;
+    connection->output_sent = 0;
+    return true;
+}
+
+void serve_close(Connection* connection) {
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    free(connection->output);
+    free(connection);
+    server.connections--;
+}
+
+// read while there is room and output is not backed up, write while there
+// is output, close once a client that shut down has all its answers
+void serve_update(Connection* connection) {
+    bool pending = connection->output_sent < connection->output_length;
+    if (connection->eof && !pending && !connection->selecting &&
+        connection->input_length < sizeof(serve_request)) {
+        serve_close(connection);
+        return;
+    }
+    uint32_t events = 0;
+    if (!connection->eof && connection->input_length < SERVE_INPUT_SIZE &&
+        connection->output_length - connection->output_sent <
+            SERVE_OUTPUT_LIMIT) {
+        events |= EPOLLIN;
+    }
+    if (pending) {
+        events |= EPOLLOUT;
+    }
+    if (events != connection->events) {
+        struct epoll_event event = {events, {.ptr = connection}};
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+        connection->events = events;
+    }
+}
+
+void serve_event(Connection* connection, uint32_t events) {
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        ssize_t bytes_read =
+            read(connection->fd, connection->input + connection->input_length,
+                 SERVE_INPUT_SIZE - connection->input_length);
+        if (bytes_read == 0) {
+            connection->eof = true;
+        } else if (bytes_read > 0) {
+            connection->input_length += bytes_read;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            serve_close(connection);
+            return;
+        }
+    }
+    // output drained by the last send lets backed up requests through
+    do {
+        serve_process(connection);
+        if (!serve_send(connection)) {
+            serve_close(connection);
+            return;
+        }
+    } while (connection->output_length == 0 &&
+             (connection->selecting ||
+              connection->input_length >= sizeof(serve_request)));
+    serve_update(connection);
+}
+
+void serve_accept() {
+    while (1) {
+        int fd = accept(server.listen_fd, NULL, NULL);
+        if (fd == -1) {
+            return;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        Connection* connection = calloc(1, sizeof(Connection));
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+        struct epoll_event event = {EPOLLIN, {.ptr = connection}};
+        epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &event);
+        server.connections++;
+    }
+}
+
+void serve_stop_handler(int signum) { server.stopping = 1; }
+
+// serve until SIGINT or SIGTERM, the database is closed by the caller
+void run_server(const char* path) {
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Socket path '%s' is too long.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server.listen_fd == -1 ||
+        bind(server.listen_fd, (struct sockaddr*)&address, sizeof(address)) ==
+            -1 ||
+        listen(server.listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "Unable to listen on '%s'.\n", path);
+        exit(EXIT_FAILURE);
+    }
+    server.epoll_fd = epoll_create1(0);
+    struct epoll_event listen_event = {EPOLLIN, {.ptr = NULL}};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, server.listen_fd, &listen_event);
+
+    // no SA_RESTART, epoll_wait returns EINTR
+    struct sigaction action = {.sa_handler = serve_stop_handler};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    struct epoll_event events[SERVE_MAX_EVENTS];
+    while (!server.stopping) {
+        int count = epoll_wait(server.epoll_fd, events, SERVE_MAX_EVENTS, -1);
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == NULL) {
+                serve_accept();
+            } else {
+                serve_event(events[i].data.ptr, events[i].events);
+            }
+        }
+    }
+    close(server.listen_fd);
+    unlink(path);
+}
+
+void sigint_handler(int signum) {
+    printf("\n");
+    exit(EXIT_SUCCESS);
+}
+
+void print_usage() {
+    printf(
+        "Usage: myjql [--page-size BYTES] [--compress LEVEL] [--throughput]\n"
+        "             [--quiet] [--output text|csv|binary] [--batch SCRIPT]\n"
+        "             [--report JSON] [--stats JSON] [--group-memory BYTES]\n"
+        "             [--sort-memory BYTES] [--cache-pages N]\n"
+        "             [--partitions N [--partition-by\n"
+        "             hash|range]] [--memtable ROWS] [--dirty-target PERCENT]\n"
+        "             [--checkpoint MS] [--direct-io] [--load SNAPSHOT]\n"
+        "             [--serve SOCKET] FILE|:memory:\n");
+    printf("  --page-size BYTES  page size of a new database, a power of two\n");
+    printf("                     between %d and %d (default %d)\n",
+           MIN_PAGE_SIZE, MAX_PAGE_SIZE, DEFAULT_PAGE_SIZE);
+    printf("  --compress LEVEL   compress leaf pages of a new database, level\n");
+    printf("                     %d (fast) to %d (small), 0 disables\n",
+           LZ_MIN_LEVEL, LZ_MAX_LEVEL);
+    printf("  --throughput       report statements/s on stderr at exit\n");
+    printf("  --quiet            no prompts or \"Executed.\", only results on\n");
+    printf("                     stdout, diagnostics on stderr\n");
+    printf("  --output MODE      row format, csv and binary imply --quiet\n");
+    printf("  --batch SCRIPT     execute SCRIPT instead of reading stdin,\n");
+    printf("                     implies --quiet and --throughput\n");
+    printf("  --serve SOCKET     serve the binary protocol on a Unix domain\n");
+    printf("                     socket until SIGINT or SIGTERM\n");
+    printf("  --report JSON      write throughput, latency percentiles, page\n");
+    printf("                     I/O and peak RSS to JSON at exit\n");
+    printf("  --stats JSON       write the .stats counters and the tree shape\n");
+    printf("                     to JSON at exit\n");
+    printf("  --cache-pages N    frames in the buffer pool (default %d)\n",
+           DEFAULT_CACHE_PAGES);
+    printf("  --partitions N     split a new table into N files, FILE and\n");
+    printf("                     FILE.1 .. FILE.N-1 (at most %d)\n",
+           MAX_PARTITIONS);
+    printf("  --partition-by hash|range  how keys are assigned to the\n");
+    printf("                     partitions (default hash)\n");
+    printf("  --memtable ROWS    buffer inserts in two sorted memtables of\n");
+    printf("                     ROWS rows, merged into the tree in the\n");
+    printf("                     background (default 0: off)\n");
+    printf("  --dirty-target PERCENT  a background thread writes dirty pages\n");
+    printf("                     back while more frames than this are dirty\n");
+    printf("  --checkpoint MS    write all dirty pages back every MS\n");
+    printf("                     milliseconds in the background\n");
+    printf("  --direct-io        bypass the OS page cache (O_DIRECT), the\n");
+    printf("                     buffer pool is the only cache\n");
+    printf("  --load SNAPSHOT    start a :memory: database from a .snapshot\n");
+    printf("  --group-memory BYTES  hash table size of group by, larger\n");
+    printf("                     inputs spill to temporary files (default %d)\n",
+           DEFAULT_GROUP_MEMORY);
+    printf("  --sort-memory BYTES  buffer of order by, larger inputs are\n");
+    printf("                     sorted in runs merged from temporary files\n");
+    printf("                     (default %d)\n", DEFAULT_SORT_MEMORY);
+}
+// the benchmarks link the engine without the shell's entry point
+#ifndef MYJQL_NO_MAIN
+int main(int argc, char* argv[]) {
+    const char* filename = NULL;
+    myjql_options options = {DEFAULT_PAGE_SIZE, 0, DEFAULT_CACHE_PAGES, 1,
+                             MYJQL_PARTITION_HASH, 0, 0, 0, 0, NULL};
+    const char* batch_path = NULL;
+    const char* serve_path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--page-size") == 0 && i + 1 < argc) {
+            uint32_t page_size = atoi(argv[++i]);
+            if (!page_size_valid(page_size)) {
+                fprintf(stderr, "Invalid page size '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            options.page_size = page_size;
+        } else if (strcmp(argv[i], "--compress") == 0 && i + 1 < argc) {
+            options.compression = atoi(argv[++i]);
+            if (options.compression < 0 || options.compression > LZ_MAX_LEVEL) {
+                fprintf(stderr, "Invalid compression level '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--throughput") == 0) {
+            throughput.enabled = true;
+        } else if (strcmp(argv[i], "--report") == 0 && i + 1 < argc) {
+            throughput.report_path = argv[++i];
+            throughput.enabled = true;
+        } else if (strcmp(argv[i], "--group-memory") == 0 && i + 1 < argc) {
+            group.memory_limit = strtoull(argv[++i], NULL, 10);
+            if (group.memory_limit < 4096) {
+                fprintf(stderr, "Invalid group memory '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc) {
+            sort.memory_limit = strtoull(argv[++i], NULL, 10);
+            if (sort.memory_limit < 4096) {
+                fprintf(stderr, "Invalid sort memory '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--cache-pages") == 0 && i + 1 < argc) {
+            options.cache_pages = atoi(argv[++i]);
+            if (options.cache_pages < MIN_CACHE_PAGES) {
+                fprintf(stderr, "Invalid cache size '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats.path = argv[++i];
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch_path = argv[++i];
+            output.quiet = true;
+            throughput.enabled = true;
+        } else if (strcmp(argv[i], "--partitions") == 0 && i + 1 < argc) {
+            options.partitions = atoi(argv[++i]);
+            if (options.partitions < 1 || options.partitions > MAX_PARTITIONS) {
+                fprintf(stderr, "Invalid partition count '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--partition-by") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "hash") == 0) {
+                options.partition_by = MYJQL_PARTITION_HASH;
+            } else if (strcmp(argv[i], "range") == 0) {
+                options.partition_by = MYJQL_PARTITION_RANGE;
+            } else {
+                fprintf(stderr, "Invalid partitioning '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--memtable") == 0 && i + 1 < argc) {
+            long rows = atol(argv[++i]);
+            if (rows < 0 || rows > MEMTABLE_MAX_ROWS) {
+                fprintf(stderr, "Invalid memtable size '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            options.memtable_rows = rows;
+        } else if (strcmp(argv[i], "--dirty-target") == 0 && i + 1 < argc) {
+            options.dirty_target = atoi(argv[++i]);
+            if (options.dirty_target < 1 || options.dirty_target > 100) {
+                fprintf(stderr, "Invalid dirty target '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+            options.checkpoint_ms = atoi(argv[++i]);
+            if (options.checkpoint_ms < 1) {
+                fprintf(stderr, "Invalid checkpoint interval '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--load") == 0 && i + 1 < argc) {
+            options.snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            options.direct_io = true;
+        } else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc) {
+            serve_path = argv[++i];
+            output.quiet = true;
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            output.quiet = true;
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "text") == 0) {
+                output.mode = OUTPUT_TEXT;
+            } else if (strcmp(argv[i], "csv") == 0) {
+                output.mode = OUTPUT_CSV;
+            } else if (strcmp(argv[i], "binary") == 0) {
+                output.mode = OUTPUT_BINARY;
+            } else {
+                fprintf(stderr, "Invalid output mode '%s'.\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+            if (output.mode != OUTPUT_TEXT) {
+                output.quiet = true;
+            }
+        } else if (argv[i][0] == '-') {
+            print_usage();
+            exit(EXIT_FAILURE);
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (filename == NULL) {
+        fprintf(stderr, "Must supply a database filename.\n");
+        exit(EXIT_FAILURE);
+    }
+    if (options.snapshot != NULL && strcmp(filename, MEMORY_DATABASE) != 0) {
+        fprintf(stderr, "A snapshot can only be loaded into %s.\n",
+                MEMORY_DATABASE);
+        exit(EXIT_FAILURE);
+    }
+
+    /*signal(SIGINT, &sigint_handler);*/
+
+    myjql_open(filename, &options, &shell_db);
+    clock_gettime(CLOCK_MONOTONIC, &throughput.start);
+
+    if (serve_path != NULL) {
+        run_server(serve_path);
+    } else if (batch_path != NULL) {
+        run_batch(batch_path);
+    } else {
+        input_open();
+        run_repl();
+    }
+    shell_close();
+    shell_finish();
+    return EXIT_SUCCESS;
+}
+#endif
@@ -1,35 +1,125 @@
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-#define COLUMN_B_SIZE 11
-#define TABLE_MAX_PAGES 1000
-#define PAGE_MOD 500
+#include "libmyjql.h"
+
+// frames in the buffer pool, --cache-pages
+#define DEFAULT_CACHE_PAGES 1000
+#define MIN_CACHE_PAGES 16
 #define size_of_attribute(Struct, Attribute) sizeof(((Struct*)0)->Attribute)
-const uint32_t PAGE_SIZE = 4096;
 
-#define LEAF_NODE_MAX_CELLS 250
-#define INTERNAL_NODE_MAX_CELLS 500
-const uint32_t LEAF_NODE_RIGHT_SPLIT_COUNT = 125;
-const uint32_t LEAF_NODE_LEFT_SPLIT_COUNT = 126;
-// FIXME:
-const uint32_t INTERNAL_NODE_LEFT_SPLIT_SIZE = 250;
-const uint32_t INTERNAL_NODE_RIGHT_SPLIT_SIZE = 250;
+// page size is chosen when the database is created and recorded in the file
+// header, node capacities are derived from it at runtime
+#define DEFAULT_PAGE_SIZE 4096
+#define MIN_PAGE_SIZE 4096
+#define MAX_PAGE_SIZE 65536
+#define DB_HEADER_PAGE_NUM 0
+#define DB_MAGIC "myjql01"
+#define MEMORY_DATABASE ":memory:"
+#define MEMORY_CHUNK_PAGES 256
+// compressed pages are allocated in granules so a page that grows a little
+// can still be rewritten in place
+#define PAGE_LOCATION_GRANULE 256
 
+// a frame of the buffer pool
 typedef struct {
-    int page_num;
+    int page_num;  // -1: free
     bool written;
-    void* storage;
+    bool referenced;  // clock bit, set by every get_page
+    void* storage;    // page_size bytes in the slab
+    int32_t next_free;
 } Page;
+// where a page lives in a compressed database file
+typedef struct {
+    uint64_t offset;
+    uint32_t length;    // 0: never written, page_size: stored raw
+    uint32_t capacity;  // bytes reserved at offset
+} page_location;
+// slots of a compressed file, capacity and offset only
+typedef struct {
+    page_location* slots;
+    uint32_t count;
+    uint32_t capacity;
+} slot_list;
 typedef struct {
     int file_descriptor;
-    uint32_t file_length;
+    bool direct_io;  // O_DIRECT, set before pager_open like num_frames
+    // `:memory:` databases: pages live in chunks of MEMORY_CHUNK_PAGES, the
+    // first loaded_chunks of them read from `snapshot` in one block
+    bool in_memory;
+    const char* snapshot;  // set before pager_open, NULL: empty database
+    char** memory_chunks;
+    uint32_t memory_chunks_capacity;
+    uint32_t loaded_chunks;
+    uint64_t file_length;
     uint32_t num_pages;
-    Page pages[TABLE_MAX_PAGES];
+    uint32_t page_size;
+    // buffer pool: frames are carved from one slab allocated at open, found
+    // through frame_of and replaced by a clock hand once none is free
+    Page* pages;
+    uint32_t num_frames;
+    void* slab;
+    size_t slab_size;
+    int32_t* frame_of;  // by page_num, -1: not in the pool
+    uint32_t frame_of_capacity;
+    int32_t free_frames;  // head of the free list
+    uint32_t clock_hand;
+    uint32_t dirty;         // frames with written set
+    uint32_t flush_cursor;  // the flusher goes on from this page_num
+    // compressed mode, 0 means pages are stored raw at page_num * page_size
+    uint32_t compression;
+    page_location* locations;  // indexed by page_num
+    uint32_t locations_capacity;
+    uint64_t data_end;  // relocated pages and new tables are appended here
+    // the table the header points to, and the space of the previous one,
+    // free for the next copy since the header has moved on
+    uint64_t plt_offset;
+    uint32_t plt_num_pages;
+    uint64_t plt_spare_offset;
+    uint64_t plt_spare_size;
+    // copy on write: a slot in a table on disk is not written over, the
+    // page moves and the slot is reused once no table on disk needs it
+    uint8_t* durable;        // by page_num, its slot is in a table on disk
+    slot_list* free_slots;   // by capacity / PAGE_LOCATION_GRANULE
+    slot_list released;      // dropped since the table was last copied
+    slot_list syncing;       // dropped before, free once the header moved
+    void* compress_buffer;
+    void* compress_workspace;
+    // page I/O since open
+    uint64_t pages_read;
+    uint64_t pages_written;
+    // frame lookups by get_page, an eviction replaces another page's frame
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
 } Pager;
 typedef struct {
     Pager pager;
     uint32_t root_page_num;
+    // node capacities, derived from page size
+    uint32_t leaf_node_max_cells;
+    uint32_t leaf_node_left_split_count;
+    uint32_t leaf_node_right_split_count;
+    uint32_t internal_node_max_cells;
+    uint32_t internal_node_left_split_size;
+    uint32_t internal_node_right_split_size;
 } Table;
+// stored at the beginning of page 0
+typedef struct {
+    char magic[8];
+    uint32_t page_size;
+    uint32_t root_page_num;
+    // compressed mode only: default level and the page-location table,
+    // a new copy of which is written on every sync and close
+    uint32_t compression;
+    uint32_t plt_num_pages;
+    uint64_t plt_offset;
+    // partitioned tables: every file records its place, 0 means one file
+    uint32_t partition_count;
+    uint32_t partition_index;
+    uint32_t partition_scheme;  // myjql_partitioning
+} db_header;
 typedef struct {
     Table* table;
     uint32_t page_num;
@@ -43,17 +133,13 @@ typedef struct {
     uint32_t a;
     char b[COLUMN_B_SIZE + 1];
 } Row;
-typedef struct {
-    uint32_t a;
-    char b[COLUMN_B_SIZE + 1];
-} leaf_node_body;
 typedef struct {
     NodeType node_type;
     bool is_root;
     uint32_t parent;
     uint32_t num_cells;
     uint32_t next_leaf;
-    leaf_node_body values[LEAF_NODE_MAX_CELLS];
+    leaf_node_body values[];  // table.leaf_node_max_cells
 } leaf_node;
 
 typedef struct {
@@ -65,16 +151,25 @@ typedef struct {
     bool is_root;
     uint32_t parent;
     uint32_t num_keys;
-    internal_node_body body[INTERNAL_NODE_MAX_CELLS];
     uint32_t rightest_child;
+    internal_node_body body[];  // table.internal_node_max_cells
 } internal_node;
 
+// engine state, defined in myjql.c
+extern Pager pager;
+extern Table table;
+
+void open_file(const char* filename, uint32_t page_size, int compression);
+void db_close();
+void mark_written(uint32_t page_num);
+
 Cursor* leaf_node_find(uint32_t page_num, uint32_t key);
 Cursor* internal_node_find(uint32_t page_num, uint32_t key);
 uint32_t internal_node_find_child(internal_node* node, uint32_t key);
 
 void* get_page(uint32_t page_num);
-void pager_open(const char* filename);
+void pager_open(const char* filename, uint32_t page_size, int compression);
+void table_set_page_size(uint32_t page_size);
 void print_row(Row* row);
 Cursor* table_find(uint32_t key);
 Cursor* table_start();
@@ -85,13 +180,18 @@ void deserialize_row(leaf_node_body* source, Row* destination);
 uint32_t get_unused_page_num();
 void initialize_leaf_node(leaf_node* node);
 void initialize_internal_node(internal_node* node);
-void internal_node_split(uint32_t page_num);
-void internal_node_insert(uint32_t parent_page_num, uint32_t child_page_num);
-
-leaf_node_body* cursor_value(Cursor* cursor);
-void leaf_node_delete(Cursor* cursor);
+void internal_node_split(uint32_t page_num, uint32_t level);
+void create_new_root(uint32_t right_child_page_num, uint32_t left_max_key);
+void internal_node_insert(uint32_t parent_page_num, uint32_t left_page_num,
+                          uint32_t child_page_num, uint32_t left_max_key,
+                          uint32_t level);
 
 leaf_node_body* cursor_value(Cursor* cursor);
+void cursor_advance(Cursor* cursor);
+void leaf_node_insert(Cursor* cursor, uint32_t key, Row* value);
+void leaf_node_split_and_insert(Cursor* cursor, uint32_t key, Row* value);
 void leaf_node_delete(Cursor* cursor);
+uint32_t leaf_node_delete_matching(uint32_t page_num, const char* b);
 
-void pager_flush(uint32_t page_num);
+void pager_flush(uint32_t frame);
+void pager_evict_all();
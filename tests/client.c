@@ -0,0 +1,138 @@
+/* Sends requests to a myjql --serve socket, prints the answers */
+/* Build: make tests/client */
+/* Usage: tests/client SOCKET < requests, a request per line:
+ *   insert A B, upsert A B, ignore A B, select [B], delete B, count [B],
+ *   min [B], max [B]
+ * rows and aggregate values print like the shell, `(a, b)` and `(v)`, the
+ * end of a request as `done N` or `error N`; requests are pipelined in
+ * groups of REQUEST_GROUP */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define REQUEST_GROUP 64
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t reserved;
+    uint32_t a;
+    char b[12];
+} request;
+typedef struct {
+    uint32_t status;
+    uint32_t a;
+    char b[12];
+} response;
+
+int parse_request(char* line, request* out) {
+    static const char* ops[] = {"insert", "upsert", "ignore", "select",
+                                "delete", "count",  "min",    "max"};
+    char* word = strtok(line, " \n");
+    if (word == NULL) {
+        return 0;
+    }
+    memset(out, 0, sizeof(*out));
+    for (uint8_t i = 0; i < 8; i++) {
+        if (strcmp(word, ops[i]) == 0) {
+            out->op = i + 1;
+        }
+    }
+    if (out->op == 0) {
+        fprintf(stderr, "unknown request '%s'\n", word);
+        exit(EXIT_FAILURE);
+    }
+    if (out->op <= 3) {
+        char* a = strtok(NULL, " \n");
+        out->a = a != NULL ? strtoul(a, NULL, 10) : 0;
+    }
+    char* b = strtok(NULL, " \n");
+    if (b != NULL) {
+        // b is not '\0' terminated when it fills all 12 bytes
+        size_t length = strlen(b);
+        memcpy(out->b, b, length < sizeof(out->b) ? length : sizeof(out->b));
+        out->flags = out->op <= 3 ? 0 : 1;
+    }
+    return 1;
+}
+
+void read_full(int fd, void* buffer, size_t length) {
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char*)buffer + done, length - done);
+        if (n <= 0) {
+            fprintf(stderr, "connection closed\n");
+            exit(EXIT_FAILURE);
+        }
+        done += n;
+    }
+}
+
+// print the answers to `pending` requests
+void read_answers(int fd, const request* sent, uint32_t pending) {
+    for (uint32_t i = 0; i < pending;) {
+        response answer;
+        read_full(fd, &answer, sizeof(answer));
+        if (answer.status == 1 && sent[i].op == 4) {
+            printf("(%u, %.12s)\n", answer.a, answer.b);
+        } else if (answer.status == 1) {
+            printf("(%u)\n", answer.a);
+        } else {
+            printf("%s %u\n", answer.status == 2 ? "done" : "error",
+                   answer.a);
+            i++;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s SOCKET < requests\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    strncpy(address.sun_path, argv[1], sizeof(address.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    // the server may still be starting up, give it 5 s
+    int attempts = 0;
+    while (fd != -1 &&
+           connect(fd, (struct sockaddr*)&address, sizeof(address)) == -1) {
+        if (++attempts == 100) {
+            fprintf(stderr, "cannot connect to %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        usleep(50000);
+    }
+    if (fd == -1) {
+        return EXIT_FAILURE;
+    }
+    request group[REQUEST_GROUP];
+    uint32_t pending = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        if (!parse_request(line, &group[pending])) {
+            continue;
+        }
+        if (++pending == REQUEST_GROUP) {
+            if (write(fd, group, sizeof(group)) != sizeof(group)) {
+                return EXIT_FAILURE;
+            }
+            read_answers(fd, group, pending);
+            pending = 0;
+        }
+    }
+    if (pending > 0) {
+        size_t size = pending * sizeof(request);
+        if (write(fd, group, size) != (ssize_t)size) {
+            return EXIT_FAILURE;
+        }
+        read_answers(fd, group, pending);
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
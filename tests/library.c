@@ -0,0 +1,90 @@
+/* Interleaves the steps of a select with writes through libmyjql */
+/* Build: make tests/library (links libmyjql.a) */
+/* Usage: tests/library DB MEMTABLE_ROWS, prints a line per check */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../libmyjql.h"
+
+myjql* db;
+myjql_stmt* insert;
+
+int insert_row(uint32_t a, const char* b) {
+    myjql_reset(insert);
+    myjql_bind_a(insert, a);
+    myjql_bind_b(insert, b, strlen(b));
+    return myjql_step(insert);
+}
+
+// step `select` to the end, `writes` inserts are tried after every `every`
+// rows; prints the rows, whether they were in order and how writes ended
+void step_with_writes(myjql_stmt* select, uint32_t every, uint32_t writes) {
+    uint32_t rows = 0, busy = 0, written = 0;
+    int64_t previous = -1;
+    int in_order = 1;
+    int result;
+    while ((result = myjql_step(select)) == MYJQL_ROW) {
+        const leaf_node_body* row = myjql_row(select);
+        if ((int64_t)row->a < previous) {
+            in_order = 0;
+        }
+        previous = row->a;
+        rows++;
+        if (rows % every == 0 && written < writes) {
+            written++;
+            busy += insert_row(5000 + written, "w") == MYJQL_BUSY;
+        }
+    }
+    printf("%u rows, %s, %u of %u writes busy, %s\n", rows,
+           in_order ? "in order" : "OUT OF ORDER", busy, written,
+           result == MYJQL_DONE ? "done" : "FAILED");
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s DB MEMTABLE_ROWS\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    myjql_options options = {0};
+    options.memtable_rows = atoi(argv[2]);
+    options.cache_pages = 16;
+    if (myjql_open(argv[1], &options, &db) != MYJQL_OK) {
+        fprintf(stderr, "cannot open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    myjql_prepare(db, "insert ? ?", &insert);
+    // keys out of order, so the writes below would land between the rows
+    // of the select and split the leaves it is reading
+    for (uint32_t i = 0; i < 450; i++) {
+        insert_row((i * 7919) % 4001, i % 3 == 0 ? "x" : "y");
+    }
+
+    myjql_stmt* all;
+    myjql_prepare(db, "select", &all);
+    step_with_writes(all, 10, 40);
+    // done, writes go through again
+    printf("insert after the select: %s\n",
+           insert_row(6000, "x") == MYJQL_DONE ? "done" : "FAILED");
+    myjql_reset(all);
+    step_with_writes(all, 1000, 0);
+
+    myjql_stmt* filtered;
+    myjql_prepare(db, "select ?", &filtered);
+    myjql_bind_b(filtered, "x", 1);
+    step_with_writes(filtered, 5, 20);
+
+    // a reset select no longer holds writes back
+    myjql_reset(filtered);
+    myjql_step(filtered);
+    myjql_reset(filtered);
+    printf("insert after a reset: %s\n",
+           insert_row(6001, "x") == MYJQL_DONE ? "done" : "FAILED");
+
+    myjql_finalize(filtered);
+    myjql_finalize(all);
+    myjql_finalize(insert);
+    myjql_close(db);
+    return EXIT_SUCCESS;
+}